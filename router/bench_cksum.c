@@ -0,0 +1,132 @@
+/* Times cksum_ref and each checksum kernel over several lengths and
+   alignments, in bytes per cycle (bytes per ns where there is no cycle
+   counter), and checks that every kernel and cksum itself agree with
+   cksum_ref first. Run with "make bench". The kernels are static, so this
+   includes sr_utils.c rather than linking it. */
+
+#include <time.h>
+#include "sr_utils.c"
+
+#define BUF_SIZE (65536 + 64)
+#define MIN_BYTES (64 * 1024 * 1024) /* Bytes summed per measurement */
+
+typedef uint64_t (*kernel_t)(const uint8_t *, int, uint64_t);
+
+struct kernel {
+  const char *name;
+  kernel_t sum;
+  int usable;
+};
+
+static uint8_t buf[BUF_SIZE];
+static volatile uint16_t sink;
+
+/* Final fold and complement, as in cksum. */
+static uint16_t fold(uint64_t sum) {
+  uint16_t res;
+
+  while (sum > 0xffff)
+    sum = (sum >> 16) + (sum & 0xffff);
+  res = ~sum;
+  return res ? res : 0xffff;
+}
+
+static uint64_t now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Bytes per tick of kernel k (cksum_ref for k NULL) at len and align. */
+static double rate(struct kernel *k, int len, int align) {
+  const uint8_t *data = buf + align;
+  int i, reps = MIN_BYTES / (len > 0 ? len : 1);
+  uint64_t start, ticks;
+
+  if (reps < 16)
+    reps = 16;
+  start = now();
+  for (i = 0; i < reps; i++) {
+    if (k == NULL)
+      sink = cksum_ref(data, len);
+    else
+      sink = fold(k->sum(data, len, 0));
+  }
+  ticks = now() - start;
+  return ticks == 0 ? 0 : (double) len * reps / ticks;
+}
+
+int main(void) {
+  static const int lens[] = { 20, 40, 64, 576, 1500, 9000, 65535 };
+  static const int aligns[] = { 0, 1, 2, 3 };
+  struct kernel kernels[] = {
+    { "sum64", cksum_sum64, 1 },
+#if defined(__x86_64__) || defined(__i386__)
+    { "sse2", cksum_sum_sse2, 0 },
+    { "avx2", cksum_sum_avx2, 0 },
+#endif
+  };
+  int nkernels = sizeof(kernels) / sizeof(kernels[0]);
+  int i, j, k, len, align, bad = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  kernels[1].usable = __builtin_cpu_supports("sse2");
+  kernels[2].usable = __builtin_cpu_supports("avx2");
+#endif
+  srand(1);
+  for (i = 0; i < BUF_SIZE; i++)
+    buf[i] = rand();
+
+  /* Every length up to a few cache lines past a jumbo frame, and the
+     longest, at each alignment */
+  for (align = 0; align < 8; align++) {
+    for (len = 0; len <= 9100 + 1; len++) {
+      int n = len > 9100 ? 65535 : len;
+      uint16_t want = cksum_ref(buf + align, n);
+
+      if (cksum(buf + align, n) != want) {
+        if (bad++ < 10)
+          fprintf(stderr, "cksum: len %d align %d differs from cksum_ref\n", n, align);
+      }
+      for (k = 0; k < nkernels; k++) {
+        if (kernels[k].usable && fold(kernels[k].sum(buf + align, n, 0)) != want) {
+          if (bad++ < 10)
+            fprintf(stderr, "%s: len %d align %d differs from cksum_ref\n",
+                    kernels[k].name, n, align);
+        }
+      }
+    }
+  }
+  if (bad > 0) {
+    fprintf(stderr, "bench_cksum: %d mismatches\n", bad);
+    return 1;
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  printf("bytes/cycle\n");
+#else
+  printf("bytes/ns\n");
+#endif
+  printf("%6s %5s %8s", "len", "align", "ref");
+  for (k = 0; k < nkernels; k++)
+    printf(" %8s", kernels[k].name);
+  printf("\n");
+  for (i = 0; i < (int) (sizeof(lens) / sizeof(lens[0])); i++) {
+    for (j = 0; j < (int) (sizeof(aligns) / sizeof(aligns[0])); j++) {
+      printf("%6d %5d %8.2f", lens[i], aligns[j], rate(NULL, lens[i], aligns[j]));
+      for (k = 0; k < nkernels; k++) {
+        if (kernels[k].usable)
+          printf(" %8.2f", rate(&kernels[k], lens[i], aligns[j]));
+        else
+          printf(" %8s", "-");
+      }
+      printf("\n");
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,161 @@
+/* Checks the incremental checksum updates against a full recompute with
+   cksum_ref, on random headers. Run with "make check"; an optional
+   argument seeds the random headers (default 1). Prints the first
+   mismatch of each kind and exits non-zero if there was any. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sr_protocol.h"
+#include "sr_utils.h"
+
+#define ROUNDS 200000
+#define SEG_MAX 64
+
+static int failures = 0;
+
+static void fail(const char *what, int round, uint16_t got, uint16_t want) {
+  if (failures++ < 10)
+    fprintf(stderr, "%s, round %d: got %04x, full recompute %04x\n", what, round, got, want);
+}
+
+static void fill(void *buf, int len) {
+  uint8_t *p = buf;
+  while (len-- > 0)
+    *p++ = rand();
+}
+
+/* Checksum of a tcp or udp segment with its pseudo header, as cksum_ref
+   gives it (a computed zero comes out as 0xffff). */
+static uint16_t l4_ref(sr_ip_hdr_t *ip, uint8_t *seg, int len) {
+  uint8_t buf[12 + SEG_MAX];
+  uint16_t seglen = htons(len);
+
+  memcpy(buf, &(ip->ip_src), 4);
+  memcpy(buf + 4, &(ip->ip_dst), 4);
+  buf[8] = 0;
+  buf[9] = ip->ip_p;
+  memcpy(buf + 10, &seglen, 2);
+  memcpy(buf + 12, seg, len);
+  return cksum_ref(buf, 12 + len);
+}
+
+/* Zero and 0xffff are the same number in ones' complement; an adjusted
+   tcp or ip checksum may be either where the full one is 0xffff. */
+static int same(uint16_t a, uint16_t b) {
+  return a == b || ((a == 0 || a == 0xffff) && (b == 0 || b == 0xffff));
+}
+
+/* Random ip header with a correct checksum. */
+static void random_ip(sr_ip_hdr_t *ip, uint8_t proto) {
+  fill(ip, sizeof(sr_ip_hdr_t));
+  ip->ip_v = 4;
+  ip->ip_hl = 5;
+  ip->ip_p = proto;
+  ip->ip_ttl = 2 + rand() % 254;
+  ip->ip_sum = 0;
+  ip->ip_sum = cksum_ref(ip, sizeof(sr_ip_hdr_t));
+}
+
+/* NAT rewrite of the source address and port, the way sr_router.c does
+   it: one accumulator for the pseudo header and port, the address change
+   also goes into the ip header with the ttl. */
+static void check_rewrite(int round, uint8_t proto, int zero_udp) {
+  sr_ip_hdr_t ip;
+  uint8_t seg[SEG_MAX];
+  int len = 8 + rand() % (SEG_MAX - 8 + 1);
+  int sum_at = proto == ip_protocol_tcp ? 16 : 6;
+  uint32_t new_src, acc;
+  uint16_t new_port, old_port, sum, want;
+
+  if (proto == ip_protocol_tcp && len < 20)
+    len = 20;
+  random_ip(&ip, proto);
+  fill(seg, len);
+  memset(seg + sum_at, 0, 2);
+  sum = zero_udp ? 0 : l4_ref(&ip, seg, len);
+  memcpy(seg + sum_at, &sum, 2);
+
+  fill(&new_src, 4);
+  fill(&new_port, 2);
+  memcpy(&old_port, seg, 2);
+
+  acc = cksum_diff32(0, ip.ip_src, new_src);
+  ip.ip_src = new_src;
+  ip_decrement_ttl(&ip, acc);
+  acc = cksum_diff16(acc, old_port, new_port);
+  memcpy(seg, &new_port, 2);
+  if (proto == ip_protocol_tcp)
+    sum = cksum_adjust(sum, acc);
+  else
+    sum = cksum_adjust_udp(sum, acc);
+
+  /* ip header */
+  want = ip.ip_sum;
+  ip.ip_sum = 0;
+  if (!same(want, cksum_ref(&ip, sizeof(sr_ip_hdr_t))))
+    fail("ip_decrement_ttl", round, want, cksum_ref(&ip, sizeof(sr_ip_hdr_t)));
+
+  /* tcp or udp */
+  memset(seg + sum_at, 0, 2);
+  want = l4_ref(&ip, seg, len);
+  if (proto == ip_protocol_tcp) {
+    if (!same(sum, want))
+      fail("cksum_adjust (tcp)", round, sum, want);
+  } else if (zero_udp) {
+    if (sum != 0)
+      fail("cksum_adjust_udp kept no checksum", round, sum, 0);
+  } else if (sum != want) {
+    fail("cksum_adjust_udp", round, sum, want);
+  }
+}
+
+/* Rewrite a udp port to every value: exactly the ones whose checksum
+   comes out as zero must be sent as 0xffff, never as 0 (no checksum). */
+static void check_udp_zero(int round) {
+  sr_ip_hdr_t ip;
+  uint8_t seg[SEG_MAX];
+  uint16_t old_port, sum, adjusted, want;
+  uint32_t port;
+  int hits = 0;
+
+  random_ip(&ip, ip_protocol_udp);
+  fill(seg, 16);
+  memset(seg + 6, 0, 2);
+  sum = l4_ref(&ip, seg, 16);
+  memcpy(&old_port, seg, 2);
+
+  for (port = 0; port <= 0xffff; port++) {
+    uint16_t new_port = port;
+
+    adjusted = cksum_adjust_udp(sum, cksum_diff16(0, old_port, new_port));
+    memcpy(seg, &new_port, 2);
+    want = l4_ref(&ip, seg, 16);
+    if (adjusted != want)
+      fail("cksum_adjust_udp, all ports", round, adjusted, want);
+    if (want == 0xffff)
+      hits++;
+  }
+  if (hits == 0)
+    fail("cksum_adjust_udp, no port gave a zero checksum", round, 0, 0xffff);
+}
+
+int main(int argc, char **argv) {
+  int i;
+
+  srand(argc > 1 ? atoi(argv[1]) : 1);
+  for (i = 0; i < ROUNDS; i++) {
+    check_rewrite(i, ip_protocol_tcp, 0);
+    check_rewrite(i, ip_protocol_udp, 0);
+    check_rewrite(i, ip_protocol_udp, 1);
+  }
+  for (i = 0; i < 16; i++)
+    check_udp_zero(i);
+
+  if (failures > 0) {
+    fprintf(stderr, "check_cksum: %d mismatches\n", failures);
+    return 1;
+  }
+  printf("check_cksum: %d rewrites match a full recompute\n", 3 * ROUNDS);
+  return 0;
+}
@@ -0,0 +1,159 @@
+/* Checks that an outbound SYN cancels the unsolicited SYN parked for the
+   same tuple when its mapping's port is borrowed from another shard, the
+   simultaneous open case: the SYN is parked while the port is unmapped,
+   then the internal host's mapping gets that port. Run with "make check".
+   Exits non-zero on failure. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "sr_nat.h"
+#include "sr_router.h"
+
+#define EXT_IP  0xc0a80001 /* 192.168.0.1 */
+#define PEER_IP 0x08080808
+#define PEER_PORT 4444
+
+static struct sr_nat nat;
+static FILE *report;
+
+/* sr_vns_comm.o wants this from sr_main.o, which has its own main */
+int sr_verify_routing_table(struct sr_instance *sr) {
+  return 0;
+}
+
+static int init_nat(void) {
+  memset(&nat, 0, sizeof(nat));
+  nat.capacity = 8192;
+  nat.naddrs = 1;
+  nat.addrs[0].ip = htonl(EXT_IP);
+  nat.icmp_timeout_int = 60;
+  nat.tcp_idle_timeout = 7440;
+  nat.transitory_idle_timeout = 300;
+  nat.udp_idle_timeout = 300;
+  return sr_nat_init(&nat);
+}
+
+/* Park a SYN from the peer to port (host byte order) of the external
+   address. */
+static int park(uint16_t port) {
+  uint8_t frame[sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t)];
+  sr_ip_hdr_t *ip = (sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+  sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *) (ip + 1);
+
+  memset(frame, 0, sizeof(frame));
+  ip->ip_v = 4;
+  ip->ip_hl = 5;
+  ip->ip_p = ip_protocol_tcp;
+  ip->ip_src = htonl(PEER_IP);
+  ip->ip_dst = htonl(EXT_IP);
+  tcp->src_port = htons(PEER_PORT);
+  tcp->dst_port = htons(port);
+  tcp->syn = 1;
+  return sr_nat_park_syn(&nat, frame, sizeof(frame), "eth2");
+}
+
+/* Whether a SYN to port (host byte order) is parked in shard. */
+static int parked(int shard, uint16_t port) {
+  struct sr_nat_syn *syn;
+
+  for (syn = nat.shards[shard].parked_syns; syn != NULL; syn = syn->next) {
+    if (syn->aux_ext == htons(port)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(void) {
+  uint32_t ip_int = htonl(0x0a000001);
+  struct sr_nat_mapping *mapping;
+  struct sr_nat_handle handle;
+  int own, lender, i, n = 0, failures = 0;
+  uint16_t port, first;
+
+  /* The table logs every allocation to stdout, keep only the result */
+  report = fdopen(dup(1), "w");
+  if (report == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+    perror("check_syn");
+    return 1;
+  }
+  if (init_nat() != 0) {
+    fprintf(stderr, "check_syn: cannot set up the table\n");
+    return 1;
+  }
+
+  /* Use up the host's own shard's ports */
+  mapping = sr_nat_acquire_new(&nat, ip_int, htons(1), 0, nat_mapping_tcp);
+  if (mapping == NULL) {
+    fprintf(stderr, "check_syn: no first mapping\n");
+    return 1;
+  }
+  sr_nat_get_handle(&nat, mapping, &handle);
+  sr_nat_release_mapping(&nat, mapping);
+  own = handle.shard;
+  lender = (own + 1) & (SR_NAT_SHARDS - 1);
+  first = MIN_PORT + ((own - MIN_PORT) & (SR_NAT_SHARDS - 1));
+  for (n = 2; n <= (TOTAL_PORTS - first) / SR_NAT_SHARDS + 1; n++) {
+    mapping = sr_nat_acquire_new(&nat, ip_int, htons(n), 0, nat_mapping_tcp);
+    if (mapping == NULL) {
+      fprintf(stderr, "check_syn: table full before borrowing\n");
+      return 1;
+    }
+    port = ntohs(mapping->aux_ext);
+    sr_nat_release_mapping(&nat, mapping);
+    if (port % SR_NAT_SHARDS != own) {
+      fprintf(stderr, "check_syn: borrowed before the own ports ran out\n");
+      return 1;
+    }
+  }
+
+  /* Unsolicited SYNs to the next ports the lender would hand out */
+  first = MIN_PORT + ((lender - MIN_PORT) & (SR_NAT_SHARDS - 1));
+  for (i = 0; i < SR_NAT_SYN_QUEUE; i++) {
+    if (park(first + i * SR_NAT_SHARDS) != 0) {
+      fprintf(stderr, "check_syn: cannot park SYN %d\n", i);
+      return 1;
+    }
+  }
+
+  /* The host's next mapping borrows one of them and opens the same
+     connection from inside */
+  mapping = sr_nat_acquire_new(&nat, ip_int, htons(n), 0, nat_mapping_tcp);
+  if (mapping == NULL) {
+    fprintf(stderr, "check_syn: no borrowed port\n");
+    return 1;
+  }
+  port = ntohs(mapping->aux_ext);
+  if (port % SR_NAT_SHARDS != lender || port >= first + SR_NAT_SYN_QUEUE * SR_NAT_SHARDS) {
+    fprintf(stderr, "check_syn: borrowed port %u, not one with a parked SYN\n", port);
+    sr_nat_release_mapping(&nat, mapping);
+    return 1;
+  }
+  sr_nat_cancel_syn(&nat, mapping, htonl(PEER_IP + 1), htons(PEER_PORT));
+  if (!parked(lender, port)) {
+    fprintf(stderr, "check_syn: SYN from another peer cancelled\n");
+    failures++;
+  }
+  sr_nat_cancel_syn(&nat, mapping, htonl(PEER_IP), htons(PEER_PORT));
+  sr_nat_release_mapping(&nat, mapping);
+  if (parked(lender, port)) {
+    fprintf(stderr, "check_syn: SYN to borrowed port %u still parked\n", port);
+    failures++;
+  }
+  for (i = 0; i < SR_NAT_SYN_QUEUE; i++) {
+    uint16_t other = first + i * SR_NAT_SHARDS;
+    if (other != port && !parked(lender, other)) {
+      fprintf(stderr, "check_syn: SYN to port %u lost\n", other);
+      failures++;
+    }
+  }
+
+  if (failures > 0) {
+    return 1;
+  }
+  fprintf(report, "check_syn: SYN to a borrowed port cancelled\n");
+  return 0;
+}
@@ -0,0 +1,158 @@
+/* Measures NAT replication lag end to end. Starts a standby and an active
+   table in one process, replicating over a Unix socket, inserts rounds of
+   mappings on the active table and reports how long they take to appear
+   in the standby's. Run with "make natsync-lag"; optional arguments are
+   the socket path and the number of rounds of each size (default 3). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include "sr_nat.h"
+#include "sr_natsync.h"
+#include "sr_router.h"
+
+#define SOCK_PATH "/tmp/natsync_lag.sock"
+#define TIMEOUT   10            /* Seconds to wait for a round */
+
+static struct sr_nat active, standby;
+static struct sr_natsync active_sync, standby_sync;
+static FILE *report;
+
+/* sr_vns_comm.o wants this from sr_main.o, which has its own main */
+int sr_verify_routing_table(struct sr_instance *sr) {
+    return 0;
+}
+
+static int64_t usec(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int init_nat(struct sr_nat *nat) {
+    memset(nat, 0, sizeof(struct sr_nat));
+    nat->capacity = 65536;
+    nat->icmp_timeout_int = 60;
+    nat->tcp_idle_timeout = 7440;
+    nat->transitory_idle_timeout = 300;
+    nat->udp_idle_timeout = 300;
+    return sr_nat_init(nat);
+}
+
+/* Inserts n UDP mappings of a fresh internal host on the active table
+   and waits for each to show up on the standby. Returns -1 on timeout. */
+static int round_trip(uint32_t n, uint32_t host) {
+    uint32_t ip_int = htonl(0x0a000000 + host), ip_ext = htonl(0xc0a80001);
+    uint32_t i, left = n;
+    int64_t *inserted = malloc(n * sizeof(int64_t));
+    int64_t start, lag, lag_sum = 0, lag_max = 0;
+    struct sr_nat_mapping *mapping;
+
+    start = usec();
+    for (i = 0; i < n; i++) {
+        mapping = sr_nat_acquire_new(&active, ip_int, htons(1 + i), ip_ext, nat_mapping_udp);
+        if (mapping == NULL) {
+            fprintf(stderr, "natsync_lag: active table full\n");
+            free(inserted);
+            return -1;
+        }
+        sr_nat_release_mapping(&active, mapping);
+        inserted[i] = usec();
+    }
+
+    /* Poll the standby, marking what has arrived with a zero */
+    while (left > 0) {
+        if (usec() - start > TIMEOUT * 1000000LL) {
+            fprintf(stderr, "natsync_lag: %u of %u mappings missing after %d s\n",
+                    left, n, TIMEOUT);
+            free(inserted);
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            if (inserted[i] == 0) {
+                continue;
+            }
+            mapping = sr_nat_acquire_internal(&standby, ip_int, htons(1 + i), nat_mapping_udp);
+            if (mapping == NULL) {
+                continue;
+            }
+            sr_nat_release_mapping(&standby, mapping);
+            lag = usec() - inserted[i];
+            lag_sum += lag;
+            if (lag > lag_max) {
+                lag_max = lag;
+            }
+            inserted[i] = 0;
+            left--;
+        }
+        if (left > 0) {
+            usleep(100);
+        }
+    }
+    fprintf(report, "%6u mappings: all on standby after %8.2f ms, lag avg %8.2f ms max %8.2f ms\n",
+           n, (usec() - start) / 1000.0, lag_sum / 1000.0 / n, lag_max / 1000.0);
+    free(inserted);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static const uint32_t sizes[] = { 1, 16, 256, SR_NATSYNC_BATCH, 8192 };
+    const char *path = argc > 1 ? argv[1] : SOCK_PATH;
+    int rounds = argc > 2 ? atoi(argv[2]) : 3;
+    uint32_t host = 1;
+    int i, r, connected = 0;
+    int64_t start;
+
+    /* The tables log every allocation to stdout, keep that out of the
+       report */
+    report = fdopen(dup(1), "w");
+    setvbuf(report, NULL, _IOLBF, 0);
+    if (report == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("natsync_lag");
+        return 1;
+    }
+
+    if (init_nat(&standby) != 0 || init_nat(&active) != 0) {
+        fprintf(stderr, "natsync_lag: cannot set up the tables\n");
+        return 1;
+    }
+    if (sr_natsync_init(&standby_sync, &standby, path, 1) != 0) {
+        fprintf(stderr, "natsync_lag: cannot start the standby\n");
+        return 1;
+    }
+    standby.sync = &standby_sync;
+    /* Let the standby bind before the active side first tries */
+    usleep(100000);
+    if (sr_natsync_init(&active_sync, &active, path, 0) != 0) {
+        fprintf(stderr, "natsync_lag: cannot start the active side\n");
+        return 1;
+    }
+    active.sync = &active_sync;
+
+    start = usec();
+    while (!connected && usec() - start < TIMEOUT * 1000000LL) {
+        usleep(10000);
+        pthread_mutex_lock(&(active_sync.lock));
+        connected = active_sync.connected && !active_sync.resync;
+        pthread_mutex_unlock(&(active_sync.lock));
+    }
+    if (!connected) {
+        fprintf(stderr, "natsync_lag: active side did not connect to %s\n", path);
+        return 1;
+    }
+
+    for (i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); i++) {
+        for (r = 0; r < rounds; r++) {
+            if (round_trip(sizes[i], host++) != 0) {
+                unlink(path);
+                return 1;
+            }
+        }
+    }
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include "sr_adj.h"
+#include "sr_arpcache.h"
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+
+/* Rewrites the destination MAC of adj, or marks it unresolved. */
+static void sr_adj_set(struct sr_adj *adj, const unsigned char *mac) {
+    __atomic_store_n(&(adj->seq), adj->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (mac != NULL) {
+        memcpy(adj->hdr, mac, ETHER_ADDR_LEN);
+    }
+    adj->resolved = (mac != NULL);
+    __atomic_store_n(&(adj->seq), adj->seq + 1, __ATOMIC_RELEASE);
+}
+
+struct sr_adj *sr_adj_get(struct sr_instance *sr, struct sr_rt *rt) {
+    struct sr_arpcache *cache = &(sr->cache);
+    struct sr_adj *adj;
+    struct sr_if *iface;
+    unsigned char mac[ETHER_ADDR_LEN];
+    uint16_t type = htons(ethertype_ip);
+
+    if (rt->adj != NULL) {
+        return rt->adj;
+    }
+    iface = sr_get_interface(sr, rt->interface);
+    if (iface == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&(cache->lock));
+    /* Routes through the same gateway share one adjacency */
+    for (adj = cache->adjs; adj != NULL; adj = adj->next) {
+        if (adj->ip == rt->gw.s_addr && adj->iface == iface) {
+            break;
+        }
+    }
+    if (adj == NULL) {
+        adj = calloc(1, sizeof(struct sr_adj));
+        if (adj == NULL) {
+            pthread_mutex_unlock(&(cache->lock));
+            return NULL;
+        }
+        adj->ip = rt->gw.s_addr;
+        adj->iface = iface;
+        memcpy(adj->hdr + ETHER_ADDR_LEN, iface->addr, ETHER_ADDR_LEN);
+        memcpy(adj->hdr + 2 * ETHER_ADDR_LEN, &type, sizeof(type));
+        /* The cache may know the neighbour already */
+        if (sr_arpcache_lookup_mac(cache, adj->ip, mac)) {
+            memcpy(adj->hdr, mac, ETHER_ADDR_LEN);
+            adj->resolved = 1;
+        }
+        adj->next = cache->adjs;
+        cache->adjs = adj;
+    }
+    rt->adj = adj;
+    pthread_mutex_unlock(&(cache->lock));
+
+    return adj;
+}
+
+int sr_adj_header(struct sr_adj *adj, uint8_t *packet) {
+    uint8_t hdr[sizeof(sr_ethernet_hdr_t)];
+    uint32_t seq;
+    int resolved;
+
+    while (1) {
+        seq = __atomic_load_n(&(adj->seq), __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        resolved = adj->resolved;
+        memcpy(hdr, adj->hdr, sizeof(hdr));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&(adj->seq), __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+
+    if (!resolved) {
+        return 0;
+    }
+    memcpy(packet, hdr, sizeof(hdr));
+    return 1;
+}
+
+void sr_adj_update(struct sr_adj *list, uint32_t ip, const unsigned char *mac) {
+    struct sr_adj *adj;
+
+    for (adj = list; adj != NULL; adj = adj->next) {
+        if (adj->ip == ip && (mac != NULL || adj->resolved)) {
+            sr_adj_set(adj, mac);
+        }
+    }
+}
+
+void sr_adj_destroy(struct sr_adj *list) {
+    struct sr_adj *next;
+
+    while (list != NULL) {
+        next = list->next;
+        free(list);
+        list = next;
+    }
+}
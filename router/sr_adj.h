@@ -0,0 +1,50 @@
+/* This file defines next-hop adjacencies. An adjacency is a next hop IP
+   reached through one egress interface, with the Ethernet header every
+   packet to it carries prebuilt: the neighbour's MAC, the interface's MAC
+   and the IP ethertype.
+
+   Each route points to the adjacency of its gateway, bound the first time
+   the route forwards a packet. Adjacencies live on the ARP cache, which
+   resolves them when it learns their neighbour's MAC and unresolves them
+   when the entry expires or is evicted. Forwarding is then a route lookup,
+   and, when resolved, one 14 byte copy of the header.
+
+   Writers hold the ARP cache lock and make seq odd while they change the
+   header; readers copy it without the lock and retry if seq was odd or
+   moved. Adjacencies are only freed with the cache.
+ */
+
+#ifndef SR_ADJ_H
+#define SR_ADJ_H
+
+#include <inttypes.h>
+#include "sr_protocol.h"
+
+struct sr_instance;
+struct sr_if;
+struct sr_rt;
+
+struct sr_adj {
+    uint32_t seq;               /* Odd while the header is being changed */
+    int resolved;               /* Header holds the neighbour's MAC */
+    uint32_t ip;                /* Next hop, network byte order */
+    struct sr_if *iface;        /* Egress interface */
+    uint8_t hdr[sizeof(sr_ethernet_hdr_t)];
+    struct sr_adj *next;        /* Every adjacency of the cache */
+};
+
+/* Returns the adjacency of route rt, binding it on first use. NULL if the
+   route's interface is unknown or memory ran out. */
+struct sr_adj *sr_adj_get(struct sr_instance *sr, struct sr_rt *rt);
+
+/* Copies the header of adj to the front of packet. Returns 0, leaving the
+   packet alone, if the next hop is not resolved. */
+int sr_adj_header(struct sr_adj *adj, uint8_t *packet);
+
+/* Resolves the adjacencies of ip on list to mac, or unresolves them if mac
+   is NULL. Called with the ARP cache locked. */
+void sr_adj_update(struct sr_adj *list, uint32_t ip, const unsigned char *mac);
+
+void sr_adj_destroy(struct sr_adj *list);
+
+#endif
@@ -1,4 +1,5 @@
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
@@ -7,6 +8,7 @@
 #include <sched.h>
 #include <string.h>
 #include "sr_arpcache.h"
+#include "sr_adj.h"
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_rt.h"
@@ -23,8 +25,11 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr) {
     struct sr_arpcache *cache = &(sr->cache);
     
     /* Loop over the request and send outstanding requests */     
-    struct sr_arpreq *req;
-    for (req = cache->requests; req != NULL; req = req->next) {
+    struct sr_arpreq *req, *next;
+    for (req = cache->requests; req != NULL; req = next) {
+        /* Destroying req unlinks it */
+        next = req->next;
+
         /* Check if this req is sent before*/
         if (!(req->times_sent)) {
             req->times_sent = 0;         
@@ -42,7 +47,7 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr) {
 
             }
             sr_arpreq_destroy(cache, req);
-            return;
+            continue;
             
         }else{
             /* Send the ARP request */
@@ -82,8 +87,7 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr) {
             req->sent = time(NULL);
             req->times_sent += 1;
             sr_send_packet(sr,eth_packet, /*uint8_t*/ /*unsigned int*/ len, matching_entry->interface);
-            
-            return;
+            free(eth_packet);
         }
     }
         
@@ -93,28 +97,288 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr) {
 
 /* You should not need to touch the rest of this code. */
 
+static uint32_t sr_arpcache_hash(uint32_t ip, uint32_t mask) {
+    uint32_t h = ip * 0x9e3779b1u;
+    return (h ^ (h >> 16)) & mask;
+}
+
+/* Slot of ip in the index, or the empty slot where it would go. */
+static uint32_t sr_arpcache_slot(struct sr_arpcache *cache, uint32_t ip) {
+    uint32_t h = sr_arpcache_hash(ip, cache->index_mask);
+
+    while (cache->index[h] != 0 && cache->entries[cache->index[h] - 1].ip != ip) {
+        h = (h + 1) & cache->index_mask;
+    }
+    return h;
+}
+
+static void sr_arpcache_unlink(struct sr_arpcache *cache, uint32_t i) {
+    struct sr_arpentry *e = &(cache->entries[i]);
+
+    if (e->lru_prev != SR_ARPCACHE_NONE) {
+        cache->entries[e->lru_prev].lru_next = e->lru_next;
+    } else {
+        cache->lru_head = e->lru_next;
+    }
+    if (e->lru_next != SR_ARPCACHE_NONE) {
+        cache->entries[e->lru_next].lru_prev = e->lru_prev;
+    } else {
+        cache->lru_tail = e->lru_prev;
+    }
+}
+
+/* Puts entry i at the head of the LRU list. */
+static void sr_arpcache_push(struct sr_arpcache *cache, uint32_t i) {
+    struct sr_arpentry *e = &(cache->entries[i]);
+
+    e->lru_prev = SR_ARPCACHE_NONE;
+    e->lru_next = cache->lru_head;
+    if (cache->lru_head != SR_ARPCACHE_NONE) {
+        cache->entries[cache->lru_head].lru_prev = i;
+    } else {
+        cache->lru_tail = i;
+    }
+    cache->lru_head = i;
+}
+
+/* Drops valid entry i. Entries after its slot are shifted back so every
+   probe sequence stays unbroken without tombstones. */
+static void sr_arpcache_remove(struct sr_arpcache *cache, uint32_t i) {
+    struct sr_arpentry *e = &(cache->entries[i]);
+    uint32_t h = sr_arpcache_slot(cache, e->ip), j = h, k;
+
+    sr_adj_update(cache->adjs, e->ip, NULL);
+    cache->index[h] = 0;
+    while (1) {
+        j = (j + 1) & cache->index_mask;
+        if (cache->index[j] == 0) {
+            break;
+        }
+        k = sr_arpcache_hash(cache->entries[cache->index[j] - 1].ip, cache->index_mask);
+        /* Move it back unless its home slot lies in (h, j] */
+        if ((j > h && (k <= h || k > j)) || (j < h && k <= h && k > j)) {
+            cache->index[h] = cache->index[j];
+            cache->index[j] = 0;
+            h = j;
+        }
+    }
+
+    sr_arpcache_unlink(cache, i);
+    e->valid = 0;
+    e->lru_next = cache->free;
+    cache->free = i;
+    cache->count--;
+}
+
+/* Writers bracket every change to the entries or the index, with the
+   lock held, so lookups can tell they raced one. */
+static void sr_arpcache_write_begin(struct sr_arpcache *cache) {
+    __atomic_store_n(&(cache->seq), cache->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void sr_arpcache_write_end(struct sr_arpcache *cache) {
+    __atomic_store_n(&(cache->seq), cache->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Keeps an array a lookup may still be reading until the cache goes. */
+static void sr_arpcache_retire(struct sr_arpcache *cache, void *ptr) {
+    struct sr_arpretired *r = malloc(sizeof(struct sr_arpretired));
+
+    if (ptr == NULL || r == NULL) {
+        /* Nothing to keep, or leak it rather than free it under a reader */
+        free(r);
+        return;
+    }
+    r->ptr = ptr;
+    r->next = cache->retired;
+    cache->retired = r;
+}
+
+/* Allocates an index of at least twice capacity slots and fills it from
+   the valid entries. The new index is complete before it is published,
+   and published before its mask, so a lookup never probes past the end of
+   whichever index it reads. */
+static int sr_arpcache_reindex(struct sr_arpcache *cache) {
+    uint32_t size = 16, i, h;
+    uint32_t *index;
+
+    while (size < 2 * cache->capacity) {
+        size *= 2;
+    }
+    index = calloc(size, sizeof(uint32_t));
+    if (index == NULL) {
+        return -1;
+    }
+    for (i = 0; i < cache->capacity; i++) {
+        if (cache->entries[i].valid) {
+            h = sr_arpcache_hash(cache->entries[i].ip, size - 1);
+            while (index[h] != 0) {
+                h = (h + 1) & (size - 1);
+            }
+            index[h] = i + 1;
+        }
+    }
+    sr_arpcache_retire(cache, cache->index);
+    __atomic_store_n(&(cache->index), index, __ATOMIC_RELEASE);
+    __atomic_store_n(&(cache->index_mask), size - 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Doubles the entry array, up to max_capacity. */
+static int sr_arpcache_grow(struct sr_arpcache *cache) {
+    uint32_t capacity = cache->capacity * 2, i;
+    struct sr_arpentry *entries;
+
+    if (capacity > cache->max_capacity) {
+        capacity = cache->max_capacity;
+    }
+    if (capacity <= cache->capacity) {
+        return -1;
+    }
+    entries = malloc(capacity * sizeof(struct sr_arpentry));
+    if (entries == NULL) {
+        return -1;
+    }
+    memcpy(entries, cache->entries, cache->capacity * sizeof(struct sr_arpentry));
+    sr_arpcache_retire(cache, cache->entries);
+    __atomic_store_n(&(cache->entries), entries, __ATOMIC_RELEASE);
+    for (i = capacity; i > cache->capacity; i--) {
+        entries[i - 1].valid = 0;
+        entries[i - 1].lru_next = cache->free;
+        cache->free = i - 1;
+    }
+    cache->capacity = capacity;
+    printf("[ARP] Cache grown to %u entries\n", capacity);
+    return sr_arpcache_reindex(cache);
+}
+
+/* Least recently used entry, after giving the ones looked up since their
+   last turn another round from the head. */
+static uint32_t sr_arpcache_victim(struct sr_arpcache *cache) {
+    uint32_t i = cache->lru_tail, n;
+
+    for (n = 0; n < cache->count && cache->entries[i].referenced; n++) {
+        cache->entries[i].referenced = 0;
+        sr_arpcache_unlink(cache, i);
+        sr_arpcache_push(cache, i);
+        i = cache->lru_tail;
+    }
+    return i;
+}
+
+/* Copies the entry for ip without the lock: the copy is taken between two
+   reads of seq and retried unless both are the same even value. */
+static int sr_arpcache_read(struct sr_arpcache *cache, uint32_t ip, struct sr_arpentry *copy) {
+    struct sr_arpentry *entries, *entry;
+    uint32_t *index;
+    uint32_t seq, mask, h, n, i;
+
+    while (1) {
+        seq = __atomic_load_n(&(cache->seq), __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        mask = __atomic_load_n(&(cache->index_mask), __ATOMIC_ACQUIRE);
+        index = __atomic_load_n(&(cache->index), __ATOMIC_ACQUIRE);
+        entries = __atomic_load_n(&(cache->entries), __ATOMIC_ACQUIRE);
+
+        entry = NULL;
+        h = sr_arpcache_hash(ip, mask);
+        for (n = 0; n <= mask; n++) {
+            i = index[h];
+            if (i == 0) {
+                break;
+            }
+            if (entries[i - 1].ip == ip) {
+                entry = &(entries[i - 1]);
+                memcpy(copy, entry, sizeof(struct sr_arpentry));
+                break;
+            }
+            h = (h + 1) & mask;
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&(cache->seq), __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        return 0;
+    }
+    /* Only written when it changes, so hot entries stay shared between cores */
+    if (!copy->referenced) {
+        __atomic_store_n(&(entry->referenced), 1, __ATOMIC_RELAXED);
+    }
+    return 1;
+}
+
+int sr_arpcache_lookup_mac(struct sr_arpcache *cache, uint32_t ip, unsigned char *mac) {
+    struct sr_arpentry entry;
+
+    if (!sr_arpcache_read(cache, ip, &entry)) {
+        return 0;
+    }
+    memcpy(mac, entry.mac, 6);
+    return 1;
+}
+
+/* Pending request for ip, or NULL. */
+static struct sr_arpreq *sr_arpreq_find(struct sr_arpcache *cache, uint32_t ip) {
+    struct sr_arpreq *req = cache->req_index[sr_arpcache_hash(ip, SR_ARPREQ_BUCKETS - 1)];
+
+    while (req != NULL && req->ip != ip) {
+        req = req->hnext;
+    }
+    return req;
+}
+
+/* Takes req off the request queue and out of the index, if still there. */
+static void sr_arpreq_unlink(struct sr_arpcache *cache, struct sr_arpreq *req) {
+    struct sr_arpreq **p = &(cache->req_index[sr_arpcache_hash(req->ip, SR_ARPREQ_BUCKETS - 1)]);
+
+    if (!req->queued) {
+        return;
+    }
+    while (*p != req) {
+        p = &((*p)->hnext);
+    }
+    *p = req->hnext;
+    if (req->prev != NULL) {
+        req->prev->next = req->next;
+    } else {
+        cache->requests = req->next;
+    }
+    if (req->next != NULL) {
+        req->next->prev = req->prev;
+    }
+    req->queued = 0;
+}
+
+static void sr_arpreq_drop_oldest(struct sr_arpcache *cache, struct sr_arpreq *req) {
+    struct sr_packet *pkt = req->packets;
+
+    req->packets = pkt->next;
+    if (req->packets == NULL) {
+        req->last = NULL;
+    }
+    req->npackets--;
+    req->dropped++;
+    sr_pool_free(&(cache->packets), pkt);
+}
+
 /* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
    You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
-    pthread_mutex_lock(&(cache->lock));
-    
-    struct sr_arpentry *entry = NULL, *copy = NULL;
-    
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if ((cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
-            entry = &(cache->entries[i]);
-        }
-    }
+    struct sr_arpentry entry, *copy = NULL;
     
     /* Must return a copy b/c another thread could jump in and modify
        table after we return. */
-    if (entry) {
+    if (sr_arpcache_read(cache, ip, &entry)) {
         copy = (struct sr_arpentry *) malloc(sizeof(struct sr_arpentry));
-        memcpy(copy, entry, sizeof(struct sr_arpentry));
+        memcpy(copy, &entry, sizeof(struct sr_arpentry));
     }
-        
-    pthread_mutex_unlock(&(cache->lock));
     
     return copy;
 }
@@ -133,32 +397,60 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
 {
     pthread_mutex_lock(&(cache->lock));
     
-    struct sr_arpreq *req;
-    for (req = cache->requests; req != NULL; req = req->next) {
-        if (req->ip == ip) {
-            break;
-        }
-    }
+    struct sr_arpreq *req = sr_arpreq_find(cache, ip);
     
     /* If the IP wasn't found, add it */
     if (!req) {
+        struct sr_arpreq **bucket = &(cache->req_index[sr_arpcache_hash(ip, SR_ARPREQ_BUCKETS - 1)]);
+
         req = (struct sr_arpreq *) calloc(1, sizeof(struct sr_arpreq));
+        if (req == NULL) {
+            pthread_mutex_unlock(&(cache->lock));
+            return NULL;
+        }
         req->ip = ip;
+        req->hnext = *bucket;
+        *bucket = req;
         req->next = cache->requests;
+        if (req->next != NULL) {
+            req->next->prev = req;
+        }
         cache->requests = req;
+        req->queued = 1;
     }
     
-    /* Add the packet to the list of packets for this request */
+    /* Add the packet to the end of the packets for this request, making
+       room from the front */
     if (packet && packet_len && iface) {
-        struct sr_packet *new_pkt = (struct sr_packet *)malloc(sizeof(struct sr_packet));
-        
-        new_pkt->buf = (uint8_t *)malloc(packet_len);
-        memcpy(new_pkt->buf, packet, packet_len);
-        new_pkt->len = packet_len;
-		new_pkt->iface = (char *)malloc(sr_IFACE_NAMELEN);
-        strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
-        new_pkt->next = req->packets;
-        req->packets = new_pkt;
+        struct sr_packet *new_pkt = NULL;
+
+        if (packet_len <= SR_ARPREQ_FRAME) {
+            if (req->npackets >= cache->queue_depth) {
+                sr_arpreq_drop_oldest(cache, req);
+            }
+            new_pkt = sr_pool_alloc(&(cache->packets));
+            if (new_pkt == NULL && req->packets != NULL) {
+                sr_arpreq_drop_oldest(cache, req);
+                new_pkt = sr_pool_alloc(&(cache->packets));
+            }
+        }
+        if (new_pkt != NULL) {
+            new_pkt->buf = new_pkt->frame;
+            memcpy(new_pkt->buf, packet, packet_len);
+            new_pkt->len = packet_len;
+            strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN - 1);
+            new_pkt->iface[sr_IFACE_NAMELEN - 1] = '\0';
+            new_pkt->next = NULL;
+            if (req->last != NULL) {
+                req->last->next = new_pkt;
+            } else {
+                req->packets = new_pkt;
+            }
+            req->last = new_pkt;
+            req->npackets++;
+        } else {
+            req->dropped++;
+        }
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -176,35 +468,37 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
 {
     pthread_mutex_lock(&(cache->lock));
     
-    struct sr_arpreq *req, *prev = NULL, *next = NULL; 
-    for (req = cache->requests; req != NULL; req = req->next) {
-        if (req->ip == ip) {            
-            if (prev) {
-                next = req->next;
-                prev->next = next;
-            } 
-            else {
-                next = req->next;
-                cache->requests = next;
-            }
-            
-            break;
-        }
-        prev = req;
+    struct sr_arpreq *req = sr_arpreq_find(cache, ip);
+    if (req) {
+        sr_arpreq_unlink(cache, req);
     }
     
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if (!(cache->entries[i].valid))
-            break;
-    }
-    
-    if (i != SR_ARPCACHE_SZ) {
-        memcpy(cache->entries[i].mac, mac, 6);
+    uint32_t h = sr_arpcache_slot(cache, ip), i;
+
+    sr_arpcache_write_begin(cache);
+    if (cache->index[h] != 0) {
+        /* Known already, refresh it */
+        i = cache->index[h] - 1;
+        sr_arpcache_unlink(cache, i);
+    } else {
+        /* Grow while allowed, then make room from the LRU end */
+        if (cache->free == SR_ARPCACHE_NONE && sr_arpcache_grow(cache) != 0) {
+            sr_arpcache_remove(cache, sr_arpcache_victim(cache));
+        }
+        h = sr_arpcache_slot(cache, ip);
+        i = cache->free;
+        cache->free = cache->entries[i].lru_next;
         cache->entries[i].ip = ip;
-        cache->entries[i].added = time(NULL);
         cache->entries[i].valid = 1;
+        cache->entries[i].referenced = 0;
+        cache->index[h] = i + 1;
+        cache->count++;
     }
+    memcpy(cache->entries[i].mac, mac, 6);
+    cache->entries[i].added = time(NULL);
+    sr_arpcache_push(cache, i);
+    sr_arpcache_write_end(cache);
+    sr_adj_update(cache->adjs, ip, mac);
     
     pthread_mutex_unlock(&(cache->lock));
     
@@ -217,32 +511,19 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
     pthread_mutex_lock(&(cache->lock));
     
     if (entry) {
-        struct sr_arpreq *req, *prev = NULL, *next = NULL; 
-        for (req = cache->requests; req != NULL; req = req->next) {
-            if (req == entry) {                
-                if (prev) {
-                    next = req->next;
-                    prev->next = next;
-                } 
-                else {
-                    next = req->next;
-                    cache->requests = next;
-                }
-                
-                break;
-            }
-            prev = req;
+        sr_arpreq_unlink(cache, entry);
+        
+        if (entry->dropped) {
+            struct in_addr ip;
+            ip.s_addr = entry->ip;
+            printf("[ARP] Dropped %u packets waiting for %s\n", entry->dropped, inet_ntoa(ip));
         }
         
         struct sr_packet *pkt, *nxt;
         
         for (pkt = entry->packets; pkt; pkt = nxt) {
             nxt = pkt->next;
-            if (pkt->buf)
-                free(pkt->buf);
-            if (pkt->iface)
-                free(pkt->iface);
-            free(pkt);
+            sr_pool_free(&(cache->packets), pkt);
         }
         
         free(entry);
@@ -256,8 +537,9 @@ void sr_arpcache_dump(struct sr_arpcache *cache) {
     fprintf(stderr, "\nMAC            IP         ADDED                      VALID\n");
     fprintf(stderr, "-----------------------------------------------------------\n");
     
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+    /* Most recently used first */
+    uint32_t i;
+    for (i = cache->lru_head; i != SR_ARPCACHE_NONE; i = cache->entries[i].lru_next) {
         struct sr_arpentry *cur = &(cache->entries[i]);
         unsigned char *mac = cur->mac;
         fprintf(stderr, "%.1x%.1x%.1x%.1x%.1x%.1x   %.8x   %.24s   %d\n", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], ntohl(cur->ip), ctime(&(cur->added)), cur->valid);
@@ -271,9 +553,42 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
     /* Seed RNG to kick out a random entry if all entries full. */
     srand(time(NULL));
     
-    /* Invalidate all entries */
-    memset(cache->entries, 0, sizeof(cache->entries));
+    /* Invalidate all entries, all of them on the free list */
+    if (cache->max_capacity == 0) {
+        cache->max_capacity = SR_ARPCACHE_MAX;
+    }
+    cache->capacity = SR_ARPCACHE_SZ < cache->max_capacity ? SR_ARPCACHE_SZ : cache->max_capacity;
+    cache->entries = calloc(cache->capacity, sizeof(struct sr_arpentry));
+    if (cache->entries == NULL) {
+        return -1;
+    }
+    cache->free = SR_ARPCACHE_NONE;
+    uint32_t i;
+    for (i = cache->capacity; i > 0; i--) {
+        cache->entries[i - 1].lru_next = cache->free;
+        cache->free = i - 1;
+    }
+    cache->count = 0;
+    cache->seq = 0;
+    cache->lru_head = cache->lru_tail = SR_ARPCACHE_NONE;
+    cache->index = NULL;
+    cache->retired = NULL;
+    cache->adjs = NULL;
+    if (sr_arpcache_reindex(cache) != 0) {
+        free(cache->entries);
+        return -1;
+    }
     cache->requests = NULL;
+    memset(cache->req_index, 0, sizeof(cache->req_index));
+    if (cache->queue_depth == 0) {
+        cache->queue_depth = SR_ARPREQ_DEPTH;
+    }
+    if (sr_pool_init(&(cache->packets), "ARP queue", sizeof(struct sr_packet),
+                     SR_ARPREQ_PACKETS) != 0) {
+        free(cache->entries);
+        free(cache->index);
+        return -1;
+    }
     
     /* Acquire mutex lock */
     pthread_mutexattr_init(&(cache->attr));
@@ -285,6 +600,19 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
 
 /* Destroys table + table lock. Returns 0 on success. */
 int sr_arpcache_destroy(struct sr_arpcache *cache) {
+    while (cache->requests != NULL) {
+        sr_arpreq_destroy(cache, cache->requests);
+    }
+    sr_pool_destroy(&(cache->packets));
+    free(cache->entries);
+    free(cache->index);
+    sr_adj_destroy(cache->adjs);
+    while (cache->retired != NULL) {
+        struct sr_arpretired *next = cache->retired->next;
+        free(cache->retired->ptr);
+        free(cache->retired);
+        cache->retired = next;
+    }
     return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
 }
 
@@ -301,10 +629,12 @@ void *sr_arpcache_timeout(void *sr_ptr) {
     
         time_t curtime = time(NULL);
         
-        int i;    
-        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+        uint32_t i;    
+        for (i = 0; i < cache->capacity; i++) {
             if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
-                cache->entries[i].valid = 0;
+                sr_arpcache_write_begin(cache);
+                sr_arpcache_remove(cache, i);
+                sr_arpcache_write_end(cache);
             }
         }
         
@@ -70,16 +70,28 @@
 #include <time.h>
 #include <pthread.h>
 #include "sr_if.h"
+#include "sr_pool.h"
 
-#define SR_ARPCACHE_SZ    100  
+struct sr_adj;
+
+#define SR_ARPCACHE_SZ    100   /* Entries to start with */
+#define SR_ARPCACHE_MAX   4096  /* Default limit for growing, LRU eviction beyond */
+#define SR_ARPCACHE_NONE  0xffffffff
 #define SR_ARPCACHE_TO    15.0
 #define BROADCAST_mac "\xff\xff\xff\xff\xff\xff"
 
+#define SR_ARPREQ_BUCKETS 256   /* Pending requests hash, a power of 2 */
+#define SR_ARPREQ_DEPTH   32    /* Default packets held per request */
+#define SR_ARPREQ_PACKETS 1024  /* Packets held over all requests */
+#define SR_ARPREQ_FRAME   1514  /* Largest frame that can be held (MTU) */
+
+/* A packet waiting for ARP, in one pooled object with its frame. */
 struct sr_packet {
     uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
     unsigned int len;           /* Length of raw Ethernet frame */
-    char *iface;                /* The outgoing interface */
-    struct sr_packet *next;
+    char iface[sr_IFACE_NAMELEN]; /* The interface it came in on */
+    struct sr_packet *next;     /* Next packet queued after this one */
+    uint8_t frame[SR_ARPREQ_FRAME]; /* Where buf points */
 };
 
 struct sr_arpentry {
@@ -87,6 +99,10 @@ struct sr_arpentry {
     uint32_t ip;                /* IP addr in network byte order */
     time_t added;         
     int valid;
+    int referenced;             /* Looked up since it last went round the LRU list */
+    uint32_t lru_prev;          /* More recently used entry, or SR_ARPCACHE_NONE */
+    uint32_t lru_next;          /* Less recently used entry (next free one when
+                                   not valid), or SR_ARPCACHE_NONE */
 };
 
 struct sr_arpreq {
@@ -96,13 +112,50 @@ struct sr_arpreq {
                                    never sent, will be 0. */
     uint32_t times_sent;        /* Number of times this request was sent. You 
                                    should update this. */
-    struct sr_packet *packets;  /* List of pkts waiting on this req to finish */
+    struct sr_packet *packets;  /* List of pkts waiting on this req to finish,
+                                   oldest first */
+    struct sr_packet *last;     /* Newest packet, where the next one goes */
+    uint32_t npackets;
+    uint32_t dropped;           /* Oldest packets dropped to stay within depth */
+    int queued;                 /* Still on the request queue */
+    struct sr_arpreq *prev;
     struct sr_arpreq *next;
+    struct sr_arpreq *hnext;    /* Next request in the same hash bucket */
+};
+
+/* Entries live in one array and keep their index for life; an open
+   addressing table keyed by IP points into it, so lookups are a hash and a
+   short probe. Valid entries are also on a list from most to least recently
+   used. When the array is full it doubles, up to max_capacity, after which
+   the least recently used entry makes room.
+
+   Writers hold lock and make seq odd while they change entries or the
+   index. Lookups take no lock: they read under seq and retry if it was odd
+   or moved. Arrays replaced by growing are kept on the retired list until
+   sr_arpcache_destroy, so a lookup racing a resize never reads freed
+   memory. A lookup only flags its entry as referenced; eviction gives
+   referenced entries at the LRU end a second chance at the head. */
+struct sr_arpretired {
+    void *ptr;
+    struct sr_arpretired *next;
 };
 
 struct sr_arpcache {
-    struct sr_arpentry entries[SR_ARPCACHE_SZ];
+    uint32_t seq;               /* Odd while a writer is changing the table */
+    struct sr_arpentry *entries;
+    uint32_t capacity;          /* Entries allocated */
+    uint32_t max_capacity;      /* Set before sr_arpcache_init, 0 for the default */
+    uint32_t count;             /* Valid entries */
+    uint32_t free;              /* First free entry */
+    uint32_t lru_head, lru_tail; /* Most and least recently used */
+    uint32_t *index;            /* Entry + 1 by IP hash, 0 for an empty slot */
+    uint32_t index_mask;
+    struct sr_arpretired *retired;
+    struct sr_adj *adjs;        /* Next hops to keep resolved, see sr_adj.h */
     struct sr_arpreq *requests;
+    struct sr_arpreq *req_index[SR_ARPREQ_BUCKETS]; /* Requests by IP hash */
+    uint32_t queue_depth;       /* Set before sr_arpcache_init, 0 for the default */
+    struct sr_pool packets;     /* Every queued packet */
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
 };
@@ -111,11 +164,20 @@ struct sr_arpcache {
    You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
 
+/* Copies the MAC address for IP (network byte order) into mac and returns
+   1, or returns 0 if it is not in the cache. Takes no lock and allocates
+   nothing, for the forwarding path. */
+int sr_arpcache_lookup_mac(struct sr_arpcache *cache, uint32_t ip, unsigned char *mac);
+
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
    that corresponds to this ARP request. The packet argument should not be
    freed by the caller.
 
+   A request holds at most queue_depth packets, in arrival order; past that,
+   or when the packet pool runs dry, its oldest packet makes room. A packet
+   that cannot be held is dropped.
+
    A pointer to the ARP request is returned; it should be freed. The caller
    can remove the ARP request from the queue by calling sr_arpreq_destroy. */
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
@@ -23,7 +23,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <pwd.h>
+#include <signal.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #ifdef _LINUX_
 #include <getopt.h>
@@ -32,6 +36,7 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "sr_natsync.h"
 
 extern char* optarg;
 
@@ -47,12 +52,18 @@ extern char* optarg;
 #define DEFAULT_ICMP_QUERY_TIMEOUT_INTERVAL 60
 #define DEFAULT_TCP_ESTABLISHED_IDLE_TIMEOUT 7440
 #define DEFAULT_TRANSITORY_IDLE_TIMEOUT 300
+#define DEFAULT_UDP_IDLE_TIMEOUT 300
+#define DEFAULT_NAT_CAPACITY SR_NAT_DEFAULT_CAPACITY
 
 static void usage(char* );
 static void sr_init_instance(struct sr_instance* );
 static void sr_destroy_instance(struct sr_instance* );
 static void sr_set_user(struct sr_instance* );
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable);
+static void sr_snapshot_signal(int sig);
+
+/* Router whose NAT table is saved on SIGUSR1 and on the way out */
+static struct sr_instance *snapshot_sr = 0;
 
 /*-----------------------------------------------------------------------------
  *---------------------------------------------------------------------------*/
@@ -74,10 +85,22 @@ int main(int argc, char **argv)
     int icmp_timeout_int = DEFAULT_ICMP_QUERY_TIMEOUT_INTERVAL;
     int tcp_idle_timeout = DEFAULT_TCP_ESTABLISHED_IDLE_TIMEOUT;
     int transitory_idle_timeout = DEFAULT_TRANSITORY_IDLE_TIMEOUT;
+    int udp_idle_timeout = DEFAULT_UDP_IDLE_TIMEOUT;
+    int nat_capacity = DEFAULT_NAT_CAPACITY;
+    char *nat_addrs = NULL;
+    int nat_block_size = 0;
+    char *nat_quota = NULL;
+    int nat_halfopen_quota = 0;
+    unsigned int nat_low_watermark = 0, nat_high_watermark = 0;
+    char *nat_snapshot = NULL;
+    char *nat_sync = NULL;
+    int nat_standby = 0;
+    int arp_max = 0;
+    int arp_depth = 0;
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:I:E:R:n")) != EOF)
+    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:I:E:R:U:C:A:B:Q:H:W:S:P:L:a:q:n")) != EOF)
     {
         switch (c)
         {
@@ -126,6 +149,67 @@ int main(int argc, char **argv)
                 transitory_idle_timeout = atoi((char *)optarg);
                 /* Check min */
                 break;   
+            case 'U':
+                udp_idle_timeout = atoi((char *)optarg);
+                /* Check min */
+                break;
+            case 'C':
+                nat_capacity = atoi((char *)optarg);
+                if (nat_capacity <= 0) {
+                    nat_capacity = DEFAULT_NAT_CAPACITY;
+                }
+                break;
+            case 'A':
+                nat_addrs = optarg;
+                break;
+            case 'B':
+                nat_block_size = atoi((char *)optarg);
+                if (nat_block_size < 0) {
+                    nat_block_size = 0;
+                }
+                break;
+            case 'Q':
+                nat_quota = optarg;
+                break;
+            case 'H':
+                nat_halfopen_quota = atoi((char *)optarg);
+                if (nat_halfopen_quota < 0) {
+                    nat_halfopen_quota = 0;
+                }
+                break;
+            case 'W':
+                /* low,high percent of the table in use */
+                if (sscanf((char *)optarg, "%u,%u", &nat_low_watermark, &nat_high_watermark) != 2) {
+                    nat_low_watermark = nat_high_watermark = 0;
+                }
+                break;
+            case 'S':
+                nat_snapshot = optarg;
+                break;
+            case 'P':
+                /* Replicate the NAT table to the standby at this socket */
+                nat_sync = optarg;
+                nat_standby = 0;
+                break;
+            case 'L':
+                /* Run as standby, receiving the table at this socket */
+                nat_sync = optarg;
+                nat_standby = 1;
+                break;
+            case 'a':
+                /* Most ARP entries to grow to before evicting */
+                arp_max = atoi((char *) optarg);
+                if (arp_max < 0) {
+                    arp_max = 0;
+                }
+                break;
+            case 'q':
+                /* Packets held per pending ARP request, oldest dropped first */
+                arp_depth = atoi((char *) optarg);
+                if (arp_depth < 0) {
+                    arp_depth = 0;
+                }
+                break;
         } /* switch */
     } /* -- while -- */
 
@@ -183,20 +267,101 @@ int main(int argc, char **argv)
 
     /* call router init (for arp subsystem etc.) */
     /*sr_init(&sr);*/
+    /* ARP cache limit, 0 for SR_ARPCACHE_MAX */
+    sr.cache.max_capacity = arp_max;
+    /* Packets per pending ARP request, 0 for SR_ARPREQ_DEPTH */
+    sr.cache.queue_depth = arp_depth;
+    /* NAT table size, sr_nat_init preallocates this many entries */
+    sr.nat.capacity = nat_capacity;
+    /* External address pool, comma separated. Without it every mapping
+       uses the external interface's address */
+    sr.nat.naddrs = 0;
+    /* Ports per subscriber in deterministic mode, 0 for dynamic ports */
+    sr.nat.block_size = nat_block_size;
+    /* Per host quotas: -Q icmp,tcp,udp mappings and -H half-open tcp
+       connections, 0 or left out for no limit */
+    memset(sr.nat.quota, 0, sizeof(sr.nat.quota));
+    if(nat_quota != NULL){
+        char *quota = strtok(nat_quota, ",");
+        int type = 0;
+        while(quota != NULL && type < NAT_MAPPING_TYPES){
+            int n = atoi(quota);
+            sr.nat.quota[type++] = n > 0 ? n : 0;
+            quota = strtok(NULL, ",");
+        }
+    }
+    sr.nat.halfopen_quota = nat_halfopen_quota;
+    /* Timeouts shrink between these watermarks, 0 for the defaults */
+    sr.nat.low_watermark = nat_low_watermark;
+    sr.nat.high_watermark = nat_high_watermark;
+    /* Table snapshot, restored now and saved on SIGUSR1 and when the
+       session ends, which SIGINT/SIGTERM bring about */
+    sr.nat.snapshot = nat_snapshot;
+    /* Replication to or from another sr, set up once the table exists */
+    sr.nat.sync = NULL;
+    sr.nat.standby = 0;
+    if(nat == 1 && nat_snapshot != NULL){
+        snapshot_sr = &sr;
+        signal(SIGUSR1, sr_snapshot_signal);
+        signal(SIGINT, sr_snapshot_signal);
+        signal(SIGTERM, sr_snapshot_signal);
+    }
+    if(nat_addrs != NULL){
+        char *addr = strtok(nat_addrs, ",");
+        struct in_addr in;
+        while(addr != NULL && sr.nat.naddrs < SR_NAT_MAX_ADDRS){
+            if(inet_aton(addr, &in) == 0){
+                fprintf(stderr, "Bad NAT address %s\n", addr);
+                exit(1);
+            }
+            sr.nat.addrs[sr.nat.naddrs++].ip = in.s_addr;
+            addr = strtok(NULL, ",");
+        }
+    }
     if(nat == 1){
-        sr_init(&sr, nat, icmp_timeout_int, tcp_idle_timeout, transitory_idle_timeout);
+        sr_init(&sr, nat, icmp_timeout_int, tcp_idle_timeout, transitory_idle_timeout, udp_idle_timeout);
+        if(nat_sync != NULL){
+            static struct sr_natsync natsync;
+            if(sr_natsync_init(&natsync, &(sr.nat), nat_sync, nat_standby) != 0){
+                fprintf(stderr, "Cannot start NAT replication on %s\n", nat_sync);
+                exit(1);
+            }
+            sr.nat.sync = &natsync;
+        }
     }else{
-        sr_init(&sr, nat, 0, 0, 0);
+        sr_init(&sr, nat, 0, 0, 0, 0);
     }
 
     /* -- whizbang main loop ;-) */
     while( sr_read_from_server(&sr) == 1);
 
+    if(snapshot_sr != 0){
+        sr_nat_save(&(snapshot_sr->nat));
+    }
+
     sr_destroy_instance(&sr);
 
     return 0;
 }/* -- main -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_snapshot_signal(..)
+ * Scope: local
+ *
+ * SIGUSR1 only flags the request, the NAT timeout thread saves the table.
+ * SIGINT/SIGTERM end the session: whichever thread gets the signal, the
+ * main loop's next read from the server comes back empty, and main saves
+ * the table and cleans up.
+ *---------------------------------------------------------------------------*/
+
+static void sr_snapshot_signal(int sig)
+{
+    if(sig == SIGUSR1)
+    { snapshot_sr->nat.snapshot_request = SR_NAT_SNAPSHOT_SAVE; }
+    else
+    { shutdown(snapshot_sr->sockfd, SHUT_RD); }
+} /* -- sr_snapshot_signal -- */
+
 /*-----------------------------------------------------------------------------
  * Method: usage(..)
  * Scope: local
@@ -1,10 +1,17 @@
 #include <signal.h>
 #include <assert.h>
 #include "sr_nat.h"
+#include "sr_natsync.h"
+#include "sr_router.h"
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
 
 int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
 
@@ -13,7 +20,125 @@ int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
   /* Acquire mutex lock */
   pthread_mutexattr_init(&(nat->attr));
   pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
-  int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
+  int success = 0;
+
+  /* Initialize any variables here, before the timeout thread can see them */
+  int i, j;
+
+  /* All mappings and connections come from these, see sr_pool.h */
+  if (nat->capacity == 0) {
+    nat->capacity = SR_NAT_DEFAULT_CAPACITY;
+  }
+  if (sr_pool_init(&(nat->mapping_pool), "mapping", sizeof(struct sr_nat_mapping), nat->capacity) != 0 ||
+      sr_pool_init(&(nat->conn_pool), "connection", sizeof(struct sr_nat_connection), nat->capacity) != 0) {
+    fprintf(stderr, "[NAT] Cannot allocate tables for %u entries\n", nat->capacity);
+    return -1;
+  }
+  nat->last_report = time(NULL);
+
+  /* Adaptive timeouts start unscaled */
+  if (nat->high_watermark == 0 || nat->high_watermark > 100 ||
+      nat->low_watermark >= nat->high_watermark) {
+    nat->low_watermark = SR_NAT_LOW_WATERMARK;
+    nat->high_watermark = SR_NAT_HIGH_WATERMARK;
+  }
+  nat->timeout_scale = 100;
+  nat->occupancy = 0;
+
+  /* External addresses, all in one load bucket to start with */
+  if (nat->naddrs <= 0 || nat->naddrs > SR_NAT_MAX_ADDRS) {
+    nat->naddrs = 1;
+    nat->addrs[0].ip = 0;
+  }
+  nat->free_loads = NULL;
+  for (i = 1; i < SR_NAT_MAX_ADDRS; i++) {
+    nat->loads[i].next = nat->free_loads;
+    nat->free_loads = &(nat->loads[i]);
+  }
+  nat->least = &(nat->loads[0]);
+  memset(nat->least, 0, sizeof(struct sr_nat_load));
+  for (i = nat->naddrs - 1; i >= 0; i--) {
+    struct sr_nat_addr *addr = &(nat->addrs[i]);
+    addr->hosts = 0;
+    addr->load = nat->least;
+    addr->prev = NULL;
+    addr->next = nat->least->addrs;
+    if (addr->next != NULL) {
+      addr->next->prev = addr;
+    }
+    nat->least->addrs = addr;
+  }
+  if (pthread_mutex_init(&(nat->addr_lock), NULL) != 0 ||
+      pthread_mutex_init(&(nat->save_lock), NULL) != 0 ||
+      sr_pool_init(&(nat->host_pool), "host", sizeof(struct sr_nat_host), nat->capacity) != 0) {
+    return -1;
+  }
+
+  /* Deterministic port blocks */
+  nat->block_owner = NULL;
+  nat->nblocks = 0;
+  if (nat->block_size > SR_NAT_PORT_RANGE) {
+    nat->block_size = SR_NAT_PORT_RANGE;
+  }
+  if (nat->block_size > 0) {
+    nat->nblocks = SR_NAT_PORT_RANGE / nat->block_size;
+    nat->block_owner = calloc((size_t) nat->naddrs * nat->nblocks, sizeof(uint32_t));
+    if (nat->block_owner == NULL) {
+      return -1;
+    }
+    printf("[NAT] Deterministic mode: %u blocks of %u ports on %d address(es)\n",
+           nat->nblocks, nat->block_size, nat->naddrs);
+  }
+
+  /* Dynamic mode: every port starts out owned by the shard it belongs to */
+  nat->port_shard = NULL;
+  if (nat->block_size == 0) {
+    size_t n = (size_t) nat->naddrs * NAT_MAPPING_TYPES << 16, k;
+    nat->port_shard = malloc(n);
+    if (nat->port_shard == NULL) {
+      return -1;
+    }
+    for (k = 0; k < n; k++) {
+      nat->port_shard[k] = k & (SR_NAT_SHARDS - 1);
+    }
+  }
+
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+
+    memset(shard, 0, sizeof(struct sr_nat_shard));
+    shard->nat = nat;
+    if (pthread_mutex_init(&(shard->lock), &(nat->attr)) != 0 ||
+        pthread_mutex_init(&(shard->port_lock), NULL) != 0 ||
+        pthread_mutex_init(&(shard->syn_lock), NULL) != 0) {
+      success = -1;
+    }
+    sr_wheel_init(&(shard->wheel), time(NULL));
+    for (j = 0; j < SR_NAT_SYN_QUEUE; j++) {
+      shard->syns[j].next = shard->free_syns;
+      shard->free_syns = &(shard->syns[j]);
+    }
+
+    /* This shard owns the ports that are i modulo SR_NAT_SHARDS, on
+       every external address */
+    uint16_t first = MIN_PORT + ((i - MIN_PORT) & (SR_NAT_SHARDS - 1));
+    shard->ports = calloc(nat->naddrs * NAT_MAPPING_TYPES, sizeof(struct sr_portalloc));
+    if (shard->ports == NULL) {
+      return -1;
+    }
+    for (j = 0; j < nat->naddrs * NAT_MAPPING_TYPES; j++) {
+      if (sr_portalloc_init(&(shard->ports[j]), first, TOTAL_PORTS,
+                            SR_NAT_SHARDS, SR_NAT_RANDOM_PORTS) != 0) {
+        success = -1;
+      }
+    }
+  }
+
+  /* Mappings from before the restart, if any */
+  if (success == 0 && nat->snapshot != NULL) {
+    sr_nat_restore(nat);
+  }
+  nat->snapshot_request = 0;
 
   /* Initialize timeout thread */
 
@@ -23,102 +148,522 @@ int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
   pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
   pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, nat);
 
-  /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
-
-  nat->mappings = NULL;
-  memset(nat->ports, 0, TOTAL_PORTS);
-  /* Initialize any variables here */
-
   return success;
 }
 
 
 int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
 
-  pthread_mutex_lock(&(nat->lock));
+  int i, j;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    pthread_mutex_lock(&(nat->shards[i].lock));
+  }
+
+  pthread_kill(nat->thread, SIGKILL);
 
   /* free nat memory here */
+  int ret = 0;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
 
+    while (shard->mappings != NULL) {
+      destroy_nat_mapping(nat, shard->mappings);
+    }
+    for (j = 0; j < nat->naddrs * NAT_MAPPING_TYPES; j++) {
+      sr_portalloc_destroy(&(shard->ports[j]));
+    }
+    free(shard->ports);
+    shard->ports = NULL;
+    pthread_mutex_unlock(&(shard->lock));
+    ret |= pthread_mutex_destroy(&(shard->lock));
+    ret |= pthread_mutex_destroy(&(shard->port_lock));
+    ret |= pthread_mutex_destroy(&(shard->syn_lock));
+  }
+  free(nat->port_shard);
+  nat->port_shard = NULL;
+
+  sr_pool_destroy(&(nat->mapping_pool));
+  sr_pool_destroy(&(nat->conn_pool));
+  sr_pool_destroy(&(nat->host_pool));
+  pthread_mutex_destroy(&(nat->addr_lock));
+  pthread_mutex_destroy(&(nat->save_lock));
+  free(nat->block_owner);
+  nat->block_owner = NULL;
+
+  return ret || pthread_mutexattr_destroy(&(nat->attr));
+}
 
-  pthread_kill(nat->thread, SIGKILL);
-  return pthread_mutex_destroy(&(nat->lock)) &&
-    pthread_mutexattr_destroy(&(nat->attr));
+/* Send port unreachable for SYNs taken off a shard's ready list, then give
+   their slots back. Called without the shard lock so a slow send does not
+   hold up the data path. */
+static void sr_nat_answer_syns(struct sr_nat_shard *shard, struct sr_nat_syn *ready) {
+  struct sr_nat_syn *syn, *last = NULL;
+
+  for (syn = ready; syn != NULL; syn = syn->next) {
+    printf("[NAT TCP] Unsolicited SYN timed out, ICMP port unreachable\n");
+    sendICMPmessage(shard->nat->sr, 3, 3, syn->iface, syn->packet);
+    last = syn;
+  }
+
+  pthread_mutex_lock(&(shard->syn_lock));
+  last->next = shard->free_syns;
+  shard->free_syns = ready;
+  pthread_mutex_unlock(&(shard->syn_lock));
+}
+
+/* A configured timeout under the current table pressure. */
+static int sr_nat_scaled(struct sr_nat *nat, int timeout) {
+  int scaled = (int) ((int64_t) timeout * nat->timeout_scale / 100);
+  return scaled < 1 ? 1 : scaled;
+}
+
+/* Queue a mapping for the standby, if there is one. */
+static void sr_nat_sync_mark(struct sr_nat *nat, struct sr_nat_mapping *mapping) {
+  if (nat->sync != NULL) {
+    sr_natsync_mark(nat->sync, mapping->ip_int, mapping->aux_int, mapping->type);
+    mapping->synced = time(NULL);
+  }
+}
+
+/* A mapping was used. The standby learns of it every SR_NATSYNC_REFRESH
+   seconds, enough for its copy not to look idle after a failover. */
+static void sr_nat_touch(struct sr_nat *nat, struct sr_nat_mapping *mapping) {
+  mapping->last_updated = time(NULL);
+  if (nat->sync != NULL && mapping->last_updated - mapping->synced >= SR_NATSYNC_REFRESH) {
+    sr_nat_sync_mark(nat, mapping);
+  }
+}
+
+/* When an idle mapping should go away. TCP mappings live as long as they
+   have connections and are dropped a second after the last one closes. */
+static time_t sr_nat_mapping_deadline(struct sr_nat *nat, struct sr_nat_mapping *mapping) {
+  if (mapping->type == nat_mapping_icmp) {
+    return mapping->last_updated + sr_nat_scaled(nat, nat->icmp_timeout_int);
+  }
+  if (mapping->type == nat_mapping_udp) {
+    return mapping->last_updated + sr_nat_scaled(nat, nat->udp_idle_timeout);
+  }
+  return mapping->last_updated + 1;
+}
+
+/* When an idle connection should go away, given its state. */
+static time_t sr_nat_conn_deadline(struct sr_nat *nat, struct sr_nat_connection *conn) {
+  if (conn->tcp_state == TIME_WAIT) {
+    return conn->time_wait + SR_NAT_TIME_WAIT;
+  }
+  if (conn->tcp_state == ESTABLISHED) {
+    return conn->last_updated + sr_nat_scaled(nat, nat->tcp_idle_timeout);
+  }
+  return conn->last_updated + sr_nat_scaled(nat, nat->transitory_idle_timeout);
+}
+
+/* Mapping timer fired. Lookups only bump last_updated, so check whether the
+   mapping was used since it was armed and push the timer out if so. */
+static void sr_nat_mapping_expire(void *shard_ptr, struct sr_timer *timer) {
+  struct sr_nat_shard *shard = (struct sr_nat_shard *) shard_ptr;
+  struct sr_nat_mapping *mapping = (struct sr_nat_mapping *) timer->data;
+  time_t deadline;
+
+  /* Connections keep the mapping alive, the last one re-arms us */
+  if (mapping->conns != NULL) {
+    return;
+  }
+
+  deadline = sr_nat_mapping_deadline(shard->nat, mapping);
+  if (shard->nat->standby && deadline <= shard->wheel.now) {
+    deadline = shard->wheel.now + SR_NATSYNC_REFRESH;
+  }
+  if (shard->wheel.now < deadline) {
+    sr_wheel_add(&(shard->wheel), timer, deadline);
+    return;
+  }
+  destroy_nat_mapping(shard->nat, mapping);
+}
+
+/* Connection timer fired, same lazy re-arm as for mappings. */
+static void sr_nat_conn_expire(void *shard_ptr, struct sr_timer *timer) {
+  struct sr_nat_shard *shard = (struct sr_nat_shard *) shard_ptr;
+  struct sr_nat_connection *conn = (struct sr_nat_connection *) timer->data;
+  time_t deadline = sr_nat_conn_deadline(shard->nat, conn);
+
+  if (shard->nat->standby && deadline <= shard->wheel.now) {
+    deadline = shard->wheel.now + SR_NATSYNC_REFRESH;
+  }
+  if (shard->wheel.now < deadline) {
+    sr_wheel_add(&(shard->wheel), timer, deadline);
+    return;
+  }
+  destroy_tcp_conn(shard->nat, conn);
+}
 
+/* Timeouts just got shorter: pull in every timer of the shard that would
+   now fire late. Longer timeouts need nothing, the expire callbacks push
+   timers out when they fire early. */
+static void sr_nat_rearm_shard(struct sr_nat_shard *shard) {
+  struct sr_nat_mapping *mapping;
+  struct sr_nat_connection *conn;
+  time_t deadline;
+
+  for (mapping = shard->mappings; mapping != NULL; mapping = mapping->next) {
+    if (sr_timer_pending(&(mapping->timer))) {
+      deadline = sr_nat_mapping_deadline(shard->nat, mapping);
+      if (deadline < mapping->timer.expires) {
+        sr_wheel_add(&(shard->wheel), &(mapping->timer), deadline);
+      }
+    }
+    for (conn = mapping->conns; conn != NULL; conn = conn->next) {
+      deadline = sr_nat_conn_deadline(shard->nat, conn);
+      if (deadline < conn->timer.expires) {
+        sr_wheel_add(&(shard->wheel), &(conn->timer), deadline);
+      }
+    }
+  }
+}
+
+/* Timeout scale for a given occupancy, both in percent. */
+static uint32_t sr_nat_scale_for(struct sr_nat *nat, uint32_t occupancy) {
+  uint32_t scale;
+
+  if (occupancy <= nat->low_watermark) {
+    return 100;
+  }
+  if (occupancy >= nat->high_watermark) {
+    return SR_NAT_SCALE_MIN;
+  }
+  scale = 100 - (occupancy - nat->low_watermark) * (100 - SR_NAT_SCALE_MIN) /
+                (nat->high_watermark - nat->low_watermark);
+  scale -= scale % SR_NAT_SCALE_STEP;
+  return scale < SR_NAT_SCALE_MIN ? SR_NAT_SCALE_MIN : scale;
+}
+
+/* Percentage of a pool's capacity in use. */
+static uint32_t sr_nat_percent(uint32_t used, uint32_t total) {
+  return total == 0 ? 0 : (uint32_t) ((uint64_t) used * 100 / total);
 }
 
 void *sr_nat_timeout(void *nat_ptr) {  /* Periodic Timout handling */
   struct sr_nat *nat = (struct sr_nat *) nat_ptr;
+  struct sr_nat_syn *ready;
+  uint32_t ports_used[SR_NAT_MAX_ADDRS * NAT_MAPPING_TYPES];
+  uint32_t ports_total[SR_NAT_MAX_ADDRS * NAT_MAPPING_TYPES];
+  uint32_t occupancy, percent, scale, margin;
+  int i, j;
 
   while (1) {
     sleep(1.0);
-    pthread_mutex_lock(&(nat->lock));
-
-    time_t curtime = time(NULL);
-
-    /* handle periodic tasks here */
-    struct sr_nat_mapping *currMapping, *nextMapping;
-    currMapping = nat->mappings;
-
-    while (currMapping != NULL) {
-      nextMapping = currMapping->next;
-
-      if (currMapping->type == nat_mapping_icmp) { /* ICMP */
-        if (difftime(curtime, currMapping->last_updated) > nat->icmp_timeout_int) {
-          destroy_nat_mapping(nat, currMapping);
-        }
-      } else if (currMapping->type == nat_mapping_tcp) { /* TCP */
-        check_tcp_conns(nat, currMapping);
-        if (currMapping->conns == NULL && difftime(curtime, currMapping->last_updated) > 0.5) {
-          destroy_nat_mapping(nat, currMapping);
-        }
+
+    /* handle periodic tasks here: one shard at a time, and only mappings
+       and connections whose timer is due are looked at */
+    memset(ports_used, 0, sizeof(ports_used));
+    memset(ports_total, 0, sizeof(ports_total));
+    for (i = 0; i < SR_NAT_SHARDS; i++) {
+      struct sr_nat_shard *shard = &(nat->shards[i]);
+
+      pthread_mutex_lock(&(shard->lock));
+      sr_wheel_advance(&(shard->wheel), time(NULL), shard);
+      ready = shard->ready_syns;
+      shard->ready_syns = NULL;
+      pthread_mutex_unlock(&(shard->lock));
+
+      pthread_mutex_lock(&(shard->port_lock));
+      for (j = 0; j < nat->naddrs * NAT_MAPPING_TYPES; j++) {
+        ports_used[j] += shard->ports[j].nslots - shard->ports[j].nfree;
+        ports_total[j] += shard->ports[j].nslots;
+      }
+      pthread_mutex_unlock(&(shard->port_lock));
+
+      if (ready != NULL) {
+        sr_nat_answer_syns(shard, ready);
       }
-      currMapping = nextMapping;
     }
-    pthread_mutex_unlock(&(nat->lock));
+
+    /* Table pressure: the fullest of the mapping and connection tables
+       and the ports of any one address and type, over all shards since
+       they lend each other ports. Hosts are paired with an address, so a
+       full address fails its hosts however empty the others are.
+       (Per-host blocks only limit their own host.) */
+    occupancy = sr_nat_percent(sr_pool_in_use(&(nat->mapping_pool)), nat->capacity);
+    percent = sr_nat_percent(sr_pool_in_use(&(nat->conn_pool)), nat->capacity);
+    occupancy = percent > occupancy ? percent : occupancy;
+    for (j = 0; j < nat->naddrs * NAT_MAPPING_TYPES && nat->block_size == 0; j++) {
+      percent = sr_nat_percent(ports_used[j], ports_total[j]);
+      occupancy = percent > occupancy ? percent : occupancy;
+    }
+    nat->occupancy = occupancy;
+
+    /* Timeouts only grow back once occupancy is a whole step below what
+       shrank them, so a table hovering at a step boundary does not flip
+       the scale, and re-arm every timer, every other second */
+    scale = sr_nat_scale_for(nat, occupancy);
+    margin = (nat->high_watermark - nat->low_watermark) * SR_NAT_SCALE_STEP /
+             (100 - SR_NAT_SCALE_MIN);
+    if (scale > nat->timeout_scale &&
+        sr_nat_scale_for(nat, occupancy + (margin > 0 ? margin : 1)) <= nat->timeout_scale) {
+      scale = nat->timeout_scale;
+    }
+    if (scale != nat->timeout_scale) {
+      int shorter = scale < nat->timeout_scale;
+      printf("[NAT] Table %u%% full, timeouts scaled to %u%%\n", occupancy, scale);
+      nat->timeout_scale = scale;
+      for (i = 0; i < SR_NAT_SHARDS && shorter; i++) {
+        pthread_mutex_lock(&(nat->shards[i].lock));
+        sr_nat_rearm_shard(&(nat->shards[i]));
+        pthread_mutex_unlock(&(nat->shards[i].lock));
+      }
+    }
+
+    if (nat->snapshot_request != 0) {
+      nat->snapshot_request = 0;
+      sr_nat_save(nat);
+    }
+
+    if (difftime(time(NULL), nat->last_report) >= SR_NAT_REPORT_INTERVAL) {
+      nat->last_report = time(NULL);
+      printf("[NAT] %u/%u mappings, %u/%u connections in use, timeouts at %u%%\n",
+             sr_pool_in_use(&(nat->mapping_pool)), nat->capacity,
+             sr_pool_in_use(&(nat->conn_pool)), nat->capacity, nat->timeout_scale);
+    }
   }
   return NULL;
 }
- /* Periodic Timout handling */
-/*void *sr_nat_timeout(void *nat_ptr) { 
-  struct sr_nat *nat = (struct sr_nat *)nat_ptr;
-  while (1) {
-    sleep(1.0);
-    pthread_mutex_lock(&(nat->lock));
 
-    time_t curtime = time(NULL);*/
+/* Deterministic mode: address index and block number of an internal host.
+   Consecutive hosts go round robin over the addresses, then to the next
+   block. */
+static uint32_t sr_nat_block_of(struct sr_nat *nat, uint32_t ip_int, int *addr) {
+  uint32_t h = ntohl(ip_int) % ((uint32_t) nat->naddrs * nat->nblocks);
+  *addr = h % nat->naddrs;
+  return h / nat->naddrs;
+}
+
+/* Shard of an internal host. */
+static struct sr_nat_shard *sr_nat_int_shard(struct sr_nat *nat, uint32_t ip_int) {
+  if (nat->block_size > 0) {
+    int addr;
+    return &(nat->shards[sr_nat_block_of(nat, ip_int, &addr) & (SR_NAT_SHARDS - 1)]);
+  }
+  uint32_t h = ip_int * 0x9e3779b1u;
+  return &(nat->shards[h >> (32 - SR_NAT_SHARD_BITS)]);
+}
+
+/* Index of the external address ip in the pool, 0 for any address when
+   there is no pool, -1 if it is not in the pool. */
+static int sr_nat_addr_index(struct sr_nat *nat, uint32_t ip) {
+  int i;
+
+  if (nat->naddrs == 1 && nat->addrs[0].ip == 0) {
+    return 0;
+  }
+  for (i = 0; i < nat->naddrs; i++) {
+    if (nat->addrs[i].ip == ip) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Dynamic mode: which shard holds the mapping of an external port (host
+   byte order) of an address and type. */
+static uint8_t *sr_nat_port_owner(struct sr_nat *nat, int addr, sr_nat_mapping_type type,
+  uint16_t port) {
+  return &(nat->port_shard[(((size_t) addr * NAT_MAPPING_TYPES + type) << 16) + port]);
+}
+
+/* Shard owning an external port (network byte order). */
+static struct sr_nat_shard *sr_nat_ext_shard(struct sr_nat *nat, uint32_t ip_ext,
+  uint16_t aux_ext, sr_nat_mapping_type type) {
+  if (nat->block_size > 0) {
+    /* Ports below the blocks are never mapped, any shard will miss */
+    uint32_t port = ntohs(aux_ext);
+    uint32_t block = port < MIN_PORT ? 0 : (port - MIN_PORT) / nat->block_size;
+    return &(nat->shards[block & (SR_NAT_SHARDS - 1)]);
+  }
+  int addr = sr_nat_addr_index(nat, ip_ext);
+  if (addr < 0) {
+    return &(nat->shards[ntohs(aux_ext) & (SR_NAT_SHARDS - 1)]);
+  }
+  return &(nat->shards[__atomic_load_n(sr_nat_port_owner(nat, addr, type, ntohs(aux_ext)),
+                                       __ATOMIC_RELAXED)]);
+}
+
+/* Shard whose queue holds SYNs to an external port (network byte order):
+   the port's own shard in dynamic mode, wherever its mapping is later
+   made, or the block's shard. */
+static struct sr_nat_shard *sr_nat_syn_shard(struct sr_nat *nat, uint16_t aux_ext) {
+  if (nat->block_size > 0) {
+    return sr_nat_ext_shard(nat, 0, aux_ext, nat_mapping_tcp);
+  }
+  return &(nat->shards[ntohs(aux_ext) & (SR_NAT_SHARDS - 1)]);
+}
+
+/* Take a SYN off the shard's parked list. Caller holds syn_lock. */
+static void sr_nat_unpark_syn(struct sr_nat_shard *shard, struct sr_nat_syn *syn) {
+  if (syn->prev != NULL) {
+    syn->prev->next = syn->next;
+  } else {
+    shard->parked_syns = syn->next;
+  }
+  if (syn->next != NULL) {
+    syn->next->prev = syn->prev;
+  }
+}
+
+/* Parked SYN reached its deadline: move it to the ready list, the timeout
+   thread answers it after dropping the lock. A cancelled one only gives
+   its slot back. */
+static void sr_nat_syn_expire(void *shard_ptr, struct sr_timer *timer) {
+  struct sr_nat_shard *shard = (struct sr_nat_shard *) shard_ptr;
+  struct sr_nat_syn *syn = (struct sr_nat_syn *) timer->data;
+
+  pthread_mutex_lock(&(shard->syn_lock));
+  if (syn->cancelled) {
+    syn->next = shard->free_syns;
+    shard->free_syns = syn;
+  } else {
+    sr_nat_unpark_syn(shard, syn);
+    syn->next = shard->ready_syns;
+    shard->ready_syns = syn;
+  }
+  pthread_mutex_unlock(&(shard->syn_lock));
+}
+
+/* Hash of the internal side of a mapping, (type, ip_int, aux_int). */
+static unsigned int sr_nat_int_hash(uint32_t ip_int, uint16_t aux_int,
+  sr_nat_mapping_type type) {
+  uint32_t h = (ip_int ^ (uint32_t) type) * 0x9e3779b1u;
+  h = (h ^ aux_int) * 0x85ebca6bu;
+  return (h ^ (h >> 16)) & (SR_NAT_HASH_SIZE - 1);
+}
+
+/* Hash of the external side of a mapping, (type, ip_ext, aux_ext). */
+static unsigned int sr_nat_ext_hash(uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type) {
+  uint32_t h = (ip_ext ^ ((uint32_t) aux_ext | ((uint32_t) type << 16))) * 0x9e3779b1u;
+  return (h >> (32 - SR_NAT_HASH_BITS)) & (SR_NAT_HASH_SIZE - 1);
+}
+
+/* Find a mapping by its internal key. Caller must hold the shard lock. */
+static struct sr_nat_mapping *sr_nat_find_internal(struct sr_nat_shard *shard,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type) {
+  struct sr_nat_mapping *current =
+    shard->int_index[sr_nat_int_hash(ip_int, aux_int, type)];
+
+  for (; current != NULL; current = current->int_next) {
+    if (current->type == type && current->aux_int == aux_int && current->ip_int == ip_int) {
+      return current;
+    }
+  }
+  return NULL;
+}
 
-    /* handle periodic tasks here */
+/* Find a mapping by its external key. Caller must hold the shard lock. */
+static struct sr_nat_mapping *sr_nat_find_external(struct sr_nat_shard *shard,
+  uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type) {
+  struct sr_nat_mapping *current = shard->ext_index[sr_nat_ext_hash(ip_ext, aux_ext, type)];
 
-   /* pthread_mutex_unlock(&(nat->lock));
+  for (; current != NULL; current = current->ext_next) {
+    if (current->type == type && current->aux_ext == aux_ext && current->ip_ext == ip_ext) {
+      return current;
+    }
   }
   return NULL;
-}*/
+}
+
+/* Lock the shard holding the mapping of an external address and port and
+   find the mapping there (NULL on a miss). Returns the locked shard. A
+   borrowed port can change hands between reading its owner and taking
+   the lock, the lookup is then retried. */
+static struct sr_nat_shard *sr_nat_lock_external(struct sr_nat *nat, uint32_t ip_ext,
+  uint16_t aux_ext, sr_nat_mapping_type type, struct sr_nat_mapping **mapping) {
+  struct sr_nat_shard *shard;
+
+  while (1) {
+    shard = sr_nat_ext_shard(nat, ip_ext, aux_ext, type);
+    pthread_mutex_lock(&(shard->lock));
+    *mapping = sr_nat_find_external(shard, ip_ext, aux_ext, type);
+    if (*mapping != NULL || sr_nat_ext_shard(nat, ip_ext, aux_ext, type) == shard) {
+      return shard;
+    }
+    pthread_mutex_unlock(&(shard->lock));
+  }
+}
 
-/* Get the mapping associated with given external port.
+/* Link a mapping into the shard's mapping list and both indexes. */
+static void sr_nat_link_mapping(struct sr_nat_shard *shard, struct sr_nat_mapping *mapping) {
+  struct sr_nat_mapping **bucket;
+
+  mapping->prev = NULL;
+  mapping->next = shard->mappings;
+  if (shard->mappings != NULL) {
+    shard->mappings->prev = mapping;
+  }
+  shard->mappings = mapping;
+
+  bucket = &(shard->int_index[sr_nat_int_hash(mapping->ip_int, mapping->aux_int, mapping->type)]);
+  mapping->int_prev = NULL;
+  mapping->int_next = *bucket;
+  if (*bucket != NULL) {
+    (*bucket)->int_prev = mapping;
+  }
+  *bucket = mapping;
+
+  bucket = &(shard->ext_index[sr_nat_ext_hash(mapping->ip_ext, mapping->aux_ext, mapping->type)]);
+  mapping->ext_prev = NULL;
+  mapping->ext_next = *bucket;
+  if (*bucket != NULL) {
+    (*bucket)->ext_prev = mapping;
+  }
+  *bucket = mapping;
+}
+
+/* Unlink a mapping from the shard's mapping list and both indexes. */
+static void sr_nat_unlink_mapping(struct sr_nat_shard *shard, struct sr_nat_mapping *mapping) {
+  if (mapping->prev != NULL) {
+    mapping->prev->next = mapping->next;
+  } else {
+    shard->mappings = mapping->next;
+  }
+  if (mapping->next != NULL) {
+    mapping->next->prev = mapping->prev;
+  }
+
+  if (mapping->int_prev != NULL) {
+    mapping->int_prev->int_next = mapping->int_next;
+  } else {
+    shard->int_index[sr_nat_int_hash(mapping->ip_int, mapping->aux_int, mapping->type)] = mapping->int_next;
+  }
+  if (mapping->int_next != NULL) {
+    mapping->int_next->int_prev = mapping->int_prev;
+  }
+
+  if (mapping->ext_prev != NULL) {
+    mapping->ext_prev->ext_next = mapping->ext_next;
+  } else {
+    shard->ext_index[sr_nat_ext_hash(mapping->ip_ext, mapping->aux_ext, mapping->type)] = mapping->ext_next;
+  }
+  if (mapping->ext_next != NULL) {
+    mapping->ext_next->ext_prev = mapping->ext_prev;
+  }
+}
+
+/* Get the mapping associated with given external address and port.
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type ) {
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type ) {
 
-  pthread_mutex_lock(&(nat->lock));
+  struct sr_nat_mapping *current;
+  struct sr_nat_shard *shard = sr_nat_lock_external(nat, ip_ext, aux_ext, type, &current);
 
   /* handle lookup here, malloc and assign to copy */
-  /**/
-  struct sr_nat_mapping *current = NULL;
-  struct sr_nat_mapping *copy = malloc(sizeof(struct sr_nat_mapping));
-  current = nat->mappings;
-  
+  struct sr_nat_mapping *copy = NULL;
 
-  while (current != NULL) {
-    if (current->type == type && current->aux_ext == aux_ext) {
-      memcpy(copy, current, sizeof(struct sr_nat_mapping));
-      current->last_updated = time(NULL);
-      return copy;
-    }
-    current = current->next;
+  if (current != NULL) {
+    sr_nat_touch(nat, current);
+    copy = malloc(sizeof(struct sr_nat_mapping));
+    memcpy(copy, current, sizeof(struct sr_nat_mapping));
   }
 
-  pthread_mutex_unlock(&(nat->lock));
-  return NULL;
+  pthread_mutex_unlock(&(shard->lock));
+  return copy;
 }
 
 /* Get the mapping associated with given internal (ip, port) pair.
@@ -126,53 +671,490 @@ struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
 struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
 
-  pthread_mutex_lock(&(nat->lock));
+  struct sr_nat_shard *shard = sr_nat_int_shard(nat, ip_int);
+  pthread_mutex_lock(&(shard->lock));
 
   /* handle lookup here, malloc and assign to copy. */
-  struct sr_nat_mapping *current = NULL;
-  struct sr_nat_mapping *copy = malloc(sizeof(struct sr_nat_mapping));
-  current = nat->mappings;
+  struct sr_nat_mapping *copy = NULL;
+  struct sr_nat_mapping *current = sr_nat_find_internal(shard, ip_int, aux_int, type);
 
-  while (current != NULL) {
-    if (current->type == type && current->aux_int == aux_int && current->ip_int == ip_int) {
-      memcpy(copy, current, sizeof(struct sr_nat_mapping));
-      current->last_updated = time(NULL);
-      return copy;
+  if (current != NULL) {
+    sr_nat_touch(nat, current);
+    copy = malloc(sizeof(struct sr_nat_mapping));
+    memcpy(copy, current, sizeof(struct sr_nat_mapping));
+  }
+
+  pthread_mutex_unlock(&(shard->lock));
+  return copy;
+}
+
+/* Port allocator of a shard for an address and mapping type. */
+static struct sr_portalloc *sr_nat_ports(struct sr_nat_shard *shard, int addr,
+  sr_nat_mapping_type type) {
+  return &(shard->ports[addr * NAT_MAPPING_TYPES + type]);
+}
+
+/* Dynamic mode: a port of an address and type for a mapping of shard,
+   from the shard's own ports, or borrowed from the next shard that has
+   one left. Caller holds the shard lock. Returns -1 if every shard is
+   out of ports. */
+static int sr_nat_take_port(struct sr_nat *nat, struct sr_nat_shard *shard, int addr,
+  sr_nat_mapping_type type) {
+  int index = shard - nat->shards;
+  int i, port = -1;
+
+  for (i = 0; i < SR_NAT_SHARDS && port < 0; i++) {
+    struct sr_nat_shard *lender = &(nat->shards[(index + i) & (SR_NAT_SHARDS - 1)]);
+
+    pthread_mutex_lock(&(lender->port_lock));
+    port = sr_portalloc_alloc(sr_nat_ports(lender, addr, type));
+    if (port >= 0) {
+      __atomic_store_n(sr_nat_port_owner(nat, addr, type, port), index, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&(lender->port_lock));
+  }
+  return port;
+}
+
+/* Dynamic mode: mark a given port (host byte order) used by a mapping of
+   shard, as when state is restored. Returns -1 if it is in use. */
+static int sr_nat_reserve_port(struct sr_nat *nat, struct sr_nat_shard *shard, int addr,
+  sr_nat_mapping_type type, uint16_t port) {
+  struct sr_nat_shard *lender = &(nat->shards[port & (SR_NAT_SHARDS - 1)]);
+  int ret;
+
+  pthread_mutex_lock(&(lender->port_lock));
+  ret = sr_portalloc_reserve(sr_nat_ports(lender, addr, type), port);
+  if (ret == 0) {
+    __atomic_store_n(sr_nat_port_owner(nat, addr, type, port), shard - nat->shards,
+                     __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&(lender->port_lock));
+  return ret;
+}
+
+/* Dynamic mode: give a port (host byte order) back to the shard it came
+   from. */
+static void sr_nat_return_port(struct sr_nat *nat, int addr, sr_nat_mapping_type type,
+  uint16_t port) {
+  struct sr_nat_shard *lender = &(nat->shards[port & (SR_NAT_SHARDS - 1)]);
+
+  pthread_mutex_lock(&(lender->port_lock));
+  __atomic_store_n(sr_nat_port_owner(nat, addr, type, port), port & (SR_NAT_SHARDS - 1),
+                   __ATOMIC_RELAXED);
+  sr_portalloc_release(sr_nat_ports(lender, addr, type), port);
+  pthread_mutex_unlock(&(lender->port_lock));
+}
+
+/* Move an address to the load bucket for hosts + delta (delta is 1 or -1),
+   creating that bucket next to the current one if needed. Caller must hold
+   addr_lock. */
+static void sr_nat_addr_move(struct sr_nat *nat, struct sr_nat_addr *addr, int delta) {
+  struct sr_nat_load *cur = addr->load;
+  struct sr_nat_load *dest = delta > 0 ? cur->next : cur->prev;
+  uint32_t hosts = addr->hosts + delta;
+
+  if (dest == NULL || dest->hosts != hosts) {
+    dest = nat->free_loads;
+    nat->free_loads = dest->next;
+    dest->hosts = hosts;
+    dest->addrs = NULL;
+    if (delta > 0) {
+      dest->prev = cur;
+      dest->next = cur->next;
+    } else {
+      dest->prev = cur->prev;
+      dest->next = cur;
+    }
+    if (dest->prev != NULL) {
+      dest->prev->next = dest;
+    } else {
+      nat->least = dest;
+    }
+    if (dest->next != NULL) {
+      dest->next->prev = dest;
+    }
+  }
+
+  /* Out of the old bucket, which goes away if that was its last address */
+  if (addr->prev != NULL) {
+    addr->prev->next = addr->next;
+  } else {
+    cur->addrs = addr->next;
+  }
+  if (addr->next != NULL) {
+    addr->next->prev = addr->prev;
+  }
+  if (cur->addrs == NULL) {
+    if (cur->prev != NULL) {
+      cur->prev->next = cur->next;
+    } else {
+      nat->least = cur->next;
     }
-    current = current->next;
+    if (cur->next != NULL) {
+      cur->next->prev = cur->prev;
+    }
+    cur->next = nat->free_loads;
+    nat->free_loads = cur;
+  }
+
+  addr->prev = NULL;
+  addr->next = dest->addrs;
+  if (addr->next != NULL) {
+    addr->next->prev = addr;
   }
+  dest->addrs = addr;
+  addr->load = dest;
+  addr->hosts = hosts;
+}
+
+/* Hash of an internal host. */
+static unsigned int sr_nat_host_hash(uint32_t ip_int) {
+  uint32_t h = ip_int * 0x85ebca6bu;
+  return (h ^ (h >> 16)) & (SR_NAT_HOST_HASH_SIZE - 1);
+}
 
-  pthread_mutex_unlock(&(nat->lock));
+/* Find an internal host. Caller must hold the shard lock. */
+static struct sr_nat_host *sr_nat_find_host(struct sr_nat_shard *shard, uint32_t ip_int) {
+  struct sr_nat_host *host = shard->hosts[sr_nat_host_hash(ip_int)];
+
+  for (; host != NULL; host = host->next) {
+    if (host->ip_int == ip_int) {
+      return host;
+    }
+  }
   return NULL;
 }
 
-/* Insert a new mapping into the nat's mapping table.
-   Actually returns a copy to the new mapping, for thread safety.
- */
-struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+/* Deterministic mode: give a new host its port block. Fails if another
+   host already holds it, which means more hosts than blocks. */
+static int sr_nat_claim_block(struct sr_nat *nat, struct sr_nat_host *host) {
+  uint32_t *owner;
+  struct in_addr in;
+  int j;
+
+  host->block = sr_nat_block_of(nat, host->ip_int, &(host->addr));
+  owner = &(nat->block_owner[(size_t) host->addr * nat->nblocks + host->block]);
+  if (*owner != 0) {
+    in.s_addr = host->ip_int;
+    fprintf(stderr, "[NAT] Port block %u is held by another host, refusing %s\n",
+            host->block, inet_ntoa(in));
+    return -1;
+  }
+
+  uint16_t first = MIN_PORT + host->block * nat->block_size;
+  for (j = 0; j < NAT_MAPPING_TYPES; j++) {
+    if (sr_portalloc_init(&(host->block_ports[j]), first, first + nat->block_size - 1,
+                          1, SR_NAT_RANDOM_PORTS) != 0) {
+      while (--j >= 0) {
+        sr_portalloc_destroy(&(host->block_ports[j]));
+      }
+      return -1;
+    }
+  }
+  *owner = host->ip_int;
+
+  /* The audit record: one per subscriber, not one per flow */
+  in.s_addr = host->ip_int;
+  printf("[NAT] Block %s -> ", inet_ntoa(in));
+  in.s_addr = nat->addrs[host->addr].ip;
+  printf("%s:%u-%u\n", in.s_addr ? inet_ntoa(in) : "*", first, first + nat->block_size - 1);
+  return 0;
+}
+
+/* Deterministic mode: give a host's block back. */
+static void sr_nat_release_block(struct sr_nat *nat, struct sr_nat_host *host) {
+  struct in_addr in;
+  int j;
+
+  for (j = 0; j < NAT_MAPPING_TYPES; j++) {
+    sr_portalloc_destroy(&(host->block_ports[j]));
+  }
+  nat->block_owner[(size_t) host->addr * nat->nblocks + host->block] = 0;
+
+  in.s_addr = host->ip_int;
+  printf("[NAT] Block %s released\n", inet_ntoa(in));
+}
+
+/* Find an internal host, or add it and pair it with external address
+   want, or the least loaded one if want is -1 (its own block in
+   deterministic mode). Caller must hold the shard lock. */
+static struct sr_nat_host *sr_nat_get_host(struct sr_nat_shard *shard, uint32_t ip_int, int want) {
+  struct sr_nat *nat = shard->nat;
+  struct sr_nat_host *host = sr_nat_find_host(shard, ip_int);
+  struct sr_nat_host **bucket;
+  struct sr_nat_addr *addr;
+
+  if (host != NULL) {
+    return host;
+  }
+  host = sr_pool_alloc(&(nat->host_pool));
+  if (host == NULL) {
+    fprintf(stderr, "[NAT] Host table full (%u entries)\n", nat->capacity);
+    return NULL;
+  }
+  memset(host, 0, sizeof(struct sr_nat_host));
+  host->ip_int = ip_int;
+
+  if (nat->block_size > 0) {
+    if (sr_nat_claim_block(nat, host) != 0) {
+      sr_pool_free(&(nat->host_pool), host);
+      return NULL;
+    }
+  } else {
+    pthread_mutex_lock(&(nat->addr_lock));
+    addr = want >= 0 ? &(nat->addrs[want]) : nat->least->addrs;
+    host->addr = addr - nat->addrs;
+    sr_nat_addr_move(nat, addr, 1);
+    pthread_mutex_unlock(&(nat->addr_lock));
+  }
+
+  bucket = &(shard->hosts[sr_nat_host_hash(ip_int)]);
+  host->prev = NULL;
+  host->next = *bucket;
+  if (*bucket != NULL) {
+    (*bucket)->prev = host;
+  }
+  *bucket = host;
+  return host;
+}
+
+/* Drop a host that has no mappings left, which unpairs its address. */
+static void sr_nat_put_host(struct sr_nat_shard *shard, struct sr_nat_host *host) {
+  struct sr_nat *nat = shard->nat;
+
+  if (host->nmappings > 0) {
+    return;
+  }
+
+  if (host->prev != NULL) {
+    host->prev->next = host->next;
+  } else {
+    shard->hosts[sr_nat_host_hash(host->ip_int)] = host->next;
+  }
+  if (host->next != NULL) {
+    host->next->prev = host->prev;
+  }
+
+  if (nat->block_size > 0) {
+    sr_nat_release_block(nat, host);
+  } else {
+    pthread_mutex_lock(&(nat->addr_lock));
+    sr_nat_addr_move(nat, &(nat->addrs[host->addr]), -1);
+    pthread_mutex_unlock(&(nat->addr_lock));
+  }
+
+  sr_pool_free(&(nat->host_pool), host);
+}
 
-  pthread_mutex_lock(&(nat->lock));
+/* Set up a mapping fresh from the pool for a host whose port is already
+   taken, and put it in the shard's indexes and on its wheel. */
+static void sr_nat_fill_mapping(struct sr_nat_shard *shard, struct sr_nat_mapping *mapping,
+  struct sr_nat_host *host, uint32_t ip_int, uint16_t aux_int, uint32_t ip_ext,
+  uint16_t aux_ext, sr_nat_mapping_type type, time_t last_updated) {
 
-  /* handle insert here, create a mapping, and then return a copy of it */
-  /*struct sr_nat_mapping *mapping = NULL;*/
-  struct sr_nat_mapping *mapping = malloc(sizeof(struct sr_nat_mapping)); 
+  /* Pooled memory keeps its generation across reuse */
+  uint32_t generation = mapping->generation;
+  memset(mapping, 0, sizeof(struct sr_nat_mapping));
 
   mapping->type = type;
-  mapping->last_updated = time(NULL);
+  mapping->last_updated = last_updated;
+  mapping->generation = generation;
   mapping->ip_int = ip_int;
   mapping->aux_int = aux_int;
+  mapping->ip_ext = ip_ext;
+  mapping->aux_ext = aux_ext;
   mapping->conns = NULL;
+  mapping->host = host;
+  host->nmappings++;
+  host->ntype[type]++;
+
+  sr_nat_link_mapping(shard, mapping);
+  sr_timer_init(&(mapping->timer), sr_nat_mapping_expire, mapping);
+  sr_wheel_add(&(shard->wheel), &(mapping->timer), sr_nat_mapping_deadline(shard->nat, mapping));
+}
+
+/* Create a mapping for (ip_int, aux_int) in its shard, on the host's
+   external address or ip_ext if no pool is configured. Caller must hold
+   the shard lock. Returns NULL if the table is full or no port is free. */
+static struct sr_nat_mapping *sr_nat_create_mapping(struct sr_nat_shard *shard,
+  uint32_t ip_int, uint16_t aux_int, uint32_t ip_ext, sr_nat_mapping_type type) {
+
+  struct sr_nat_host *host = sr_nat_get_host(shard, ip_int, -1);
+  if (host == NULL) {
+    return NULL;
+  }
+  if (shard->nat->quota[type] > 0 && host->ntype[type] >= shard->nat->quota[type]) {
+    struct in_addr in;
+    in.s_addr = ip_int;
+    fprintf(stderr, "[NAT] %s is at its quota of %u mappings (type %d)\n",
+            inet_ntoa(in), shard->nat->quota[type], type);
+    return NULL;
+  }
+
+  struct sr_nat_mapping *mapping = sr_pool_alloc(&(shard->nat->mapping_pool));
+  if (mapping == NULL) {
+    fprintf(stderr, "[NAT] Mapping table full (%u entries)\n", shard->nat->capacity);
+    sr_nat_put_host(shard, host);
+    return NULL;
+  }
+
+  int port = generate_unique_port(shard->nat, host, type);
+  if (port < 0) {
+    sr_pool_free(&(shard->nat->mapping_pool), mapping);
+    sr_nat_put_host(shard, host);
+    return NULL;
+  }
+
+  if (shard->nat->addrs[host->addr].ip != 0) {
+    ip_ext = shard->nat->addrs[host->addr].ip;
+  }
+  sr_nat_fill_mapping(shard, mapping, host, ip_int, aux_int, ip_ext,
+                      htons((uint16_t) port), type, time(NULL));
+  sr_nat_sync_mark(shard->nat, mapping);
+  return mapping;
+}
 
-  struct sr_nat_mapping *head_mapping = nat->mappings;
-  nat->mappings = mapping;
-  mapping->next = head_mapping;
+/* Insert a new mapping into the nat's mapping table.
+   Returns the mapping owned by the table, or NULL if no port is free.
+ */
+struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
 
+  struct sr_nat_mapping *mapping = sr_nat_acquire_new(nat, ip_int, aux_int, 0, type);
+  if (mapping != NULL) {
+    sr_nat_release_mapping(nat, mapping);
+  }
+  return mapping;
+}
 
-  pthread_mutex_unlock(&(nat->lock));
+struct sr_nat_mapping *sr_nat_acquire_external(struct sr_nat *nat,
+  uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type) {
+
+  struct sr_nat_mapping *mapping;
+  struct sr_nat_shard *shard = sr_nat_lock_external(nat, ip_ext, aux_ext, type, &mapping);
+
+  if (mapping == NULL) {
+    pthread_mutex_unlock(&(shard->lock));
+    return NULL;
+  }
+  sr_nat_touch(nat, mapping);
   return mapping;
 }
 
+struct sr_nat_mapping *sr_nat_acquire_internal(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type) {
+
+  struct sr_nat_shard *shard = sr_nat_int_shard(nat, ip_int);
+  pthread_mutex_lock(&(shard->lock));
+
+  struct sr_nat_mapping *mapping = sr_nat_find_internal(shard, ip_int, aux_int, type);
+  if (mapping == NULL) {
+    pthread_mutex_unlock(&(shard->lock));
+    return NULL;
+  }
+  sr_nat_touch(nat, mapping);
+  return mapping;
+}
+
+struct sr_nat_mapping *sr_nat_acquire_new(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, uint32_t ip_ext, sr_nat_mapping_type type) {
+
+  struct sr_nat_shard *shard = sr_nat_int_shard(nat, ip_int);
+  pthread_mutex_lock(&(shard->lock));
+
+  /* Another packet of the same flow may have beaten us here */
+  struct sr_nat_mapping *mapping = sr_nat_find_internal(shard, ip_int, aux_int, type);
+  if (mapping == NULL) {
+    mapping = sr_nat_create_mapping(shard, ip_int, aux_int, ip_ext, type);
+    if (mapping == NULL) {
+      pthread_mutex_unlock(&(shard->lock));
+      return NULL;
+    }
+  }
+  sr_nat_touch(nat, mapping);
+  return mapping;
+}
+
+/* Lock two shards, lower index first. The locks are recursive, so the
+   same shard is simply taken twice and each release drops one. */
+static void sr_nat_lock_pair(struct sr_nat_shard *a, struct sr_nat_shard *b) {
+  if (a > b) {
+    struct sr_nat_shard *t = a;
+    a = b;
+    b = t;
+  }
+  pthread_mutex_lock(&(a->lock));
+  pthread_mutex_lock(&(b->lock));
+}
+
+static void sr_nat_unlock_pair(struct sr_nat_shard *a, struct sr_nat_shard *b) {
+  pthread_mutex_unlock(&(a->lock));
+  pthread_mutex_unlock(&(b->lock));
+}
+
+int sr_nat_acquire_hairpin(struct sr_nat *nat, uint32_t ip_int, uint16_t aux_int,
+  uint32_t ip_ext, uint32_t ip_dst, uint16_t aux_dst, sr_nat_mapping_type type,
+  struct sr_nat_mapping **src, struct sr_nat_mapping **dst) {
+
+  struct sr_nat_shard *src_shard = sr_nat_int_shard(nat, ip_int);
+  struct sr_nat_shard *dst_shard;
+
+  *src = NULL;
+  while (1) {
+    dst_shard = sr_nat_ext_shard(nat, ip_dst, aux_dst, type);
+    sr_nat_lock_pair(src_shard, dst_shard);
+    *dst = sr_nat_find_external(dst_shard, ip_dst, aux_dst, type);
+    if (*dst != NULL) {
+      break;
+    }
+    /* The port may have moved to another shard meanwhile, see
+       sr_nat_lock_external */
+    if (sr_nat_ext_shard(nat, ip_dst, aux_dst, type) == dst_shard) {
+      sr_nat_unlock_pair(src_shard, dst_shard);
+      return -1;
+    }
+    sr_nat_unlock_pair(src_shard, dst_shard);
+  }
+
+  *src = sr_nat_find_internal(src_shard, ip_int, aux_int, type);
+  if (*src == NULL) {
+    *src = sr_nat_create_mapping(src_shard, ip_int, aux_int, ip_ext, type);
+    if (*src == NULL) {
+      sr_nat_unlock_pair(src_shard, dst_shard);
+      return -1;
+    }
+  }
+  sr_nat_touch(nat, *src);
+  sr_nat_touch(nat, *dst);
+  return 0;
+}
+
+void sr_nat_release_mapping(struct sr_nat *nat, struct sr_nat_mapping *mapping) {
+  pthread_mutex_unlock(&(sr_nat_int_shard(nat, mapping->ip_int)->lock));
+}
+
+void sr_nat_get_handle(struct sr_nat *nat, struct sr_nat_mapping *mapping,
+  struct sr_nat_handle *handle) {
+  handle->mapping = mapping;
+  handle->generation = mapping->generation;
+  /* The shard sr_nat_release_mapping unlocks */
+  handle->shard = sr_nat_int_shard(nat, mapping->ip_int) - nat->shards;
+}
+
+struct sr_nat_mapping *sr_nat_acquire_handle(struct sr_nat *nat,
+  struct sr_nat_handle *handle) {
+
+  struct sr_nat_shard *shard = &(nat->shards[handle->shard]);
+  pthread_mutex_lock(&(shard->lock));
+
+  if (handle->mapping == NULL || handle->mapping->generation != handle->generation) {
+    pthread_mutex_unlock(&(shard->lock));
+    return NULL;
+  }
+  return handle->mapping;
+}
+
 /* Check if packer incoming interface is eth1 */
 int is_nat_internal_iface(char *iface) {
   return strcmp(iface, NAT_INTERNAL_INTERFACE) == 0 ? 1 : 0;
@@ -183,128 +1165,760 @@ int is_nat_external_iface(char *iface) {
   return strcmp(iface, NAT_EXTERNAL_INTERFACE) == 0 ? 1 : 0;
 }
 
-/* Generate a port for external mapping */
-int generate_unique_port(struct sr_nat *nat) {
+/* Generate a port for external mapping from the pool of the given type
+   for the host's address, in the host's shard or borrowed from another,
+   or from the host's own block in deterministic mode. Returns the port in
+   host byte order, or -1 (reported once until a port frees up) if the
+   pool is exhausted. */
+int generate_unique_port(struct sr_nat *nat, struct sr_nat_host *host, sr_nat_mapping_type type) {
+
+  struct sr_nat_shard *shard = sr_nat_int_shard(nat, host->ip_int);
+  struct in_addr in;
+  int port;
+
+  if (nat->block_size > 0) {
+    port = sr_portalloc_alloc(&(host->block_ports[type]));
+  } else {
+    port = sr_nat_take_port(nat, shard, host->addr, type);
+  }
 
-  pthread_mutex_lock(&(nat->lock));
+  if (port >= 0) {
+    printf("Allocated port: %d\n", port);
+    host->exhausted = 0;
+  } else if (!host->exhausted) {
+    host->exhausted = 1;
+    in.s_addr = host->ip_int;
+    if (nat->block_size > 0) {
+      fprintf(stderr, "[NAT] Port block of %s exhausted (%u ports, type %d)\n",
+              inet_ntoa(in), nat->block_size, type);
+    } else {
+      fprintf(stderr, "[NAT] External ports exhausted for %s (type %d)\n",
+              inet_ntoa(in), type);
+    }
+  }
 
-  uint16_t *available_ports = nat->ports;
-  int i;
+  return port;
+}
 
-  for (i = MIN_PORT; i <= TOTAL_PORTS; i++) {
-    if (available_ports[i] == 0) {
-      available_ports[i] = 1;
-      printf("Allocated port: %d\n", i);
+int sr_nat_port_block(struct sr_nat *nat, uint32_t ip_int, uint32_t *ip_ext,
+  uint16_t *first, uint16_t *last) {
+  int addr;
 
-      pthread_mutex_unlock(&(nat->lock));
-      return i;
+  if (nat->block_size == 0) {
+    return -1;
+  }
+  uint32_t block = sr_nat_block_of(nat, ip_int, &addr);
+  *ip_ext = nat->addrs[addr].ip;
+  *first = MIN_PORT + block * nat->block_size;
+  *last = *first + nat->block_size - 1;
+  return 0;
+}
+
+int sr_nat_over_quota(struct sr_nat *nat, uint32_t ip_int, sr_nat_mapping_type type) {
+  struct sr_nat_shard *shard = sr_nat_int_shard(nat, ip_int);
+  struct sr_nat_host *host;
+  int over = 0;
+
+  if (nat->quota[type] == 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&(shard->lock));
+  host = sr_nat_find_host(shard, ip_int);
+  if (host != NULL && host->ntype[type] >= nat->quota[type]) {
+    over = 1;
+  }
+  pthread_mutex_unlock(&(shard->lock));
+  return over;
+}
+
+int sr_nat_halfopen_full(struct sr_nat *nat, struct sr_nat_mapping *mapping) {
+  return nat->halfopen_quota > 0 && mapping->host->nhalfopen >= nat->halfopen_quota;
+}
+
+int sr_nat_is_external_addr(struct sr_nat *nat, uint32_t ip) {
+  int i;
+
+  for (i = 0; i < nat->naddrs; i++) {
+    if (nat->addrs[i].ip != 0 && nat->addrs[i].ip == ip) {
+      return 1;
     }
   }
+  return 0;
+}
 
-  pthread_mutex_unlock(&(nat->lock));
-  return -1;
+/* Slot of a peer in a connection table of mask + 1 slots. */
+static uint32_t sr_nat_conn_hash(uint32_t ip, uint16_t port, uint32_t mask) {
+  uint32_t h = (ip ^ ((uint32_t) port << 16)) * 0x9e3779b1u;
+  return (h ^ (h >> 15)) & mask;
 }
 
-/* Get the connection associated with the given IP in the NAT entry. */
-struct sr_nat_connection *sr_nat_lookup_tcp_con(struct sr_nat_mapping *mapping, uint32_t ip_con) {
-  struct sr_nat_connection *currConn = mapping->conns;
+/* Find a connection by peer, through the table when the mapping has one. */
+static struct sr_nat_connection *sr_nat_conn_find(struct sr_nat_mapping *mapping,
+  uint32_t ip, uint16_t port) {
+  struct sr_nat_connection *conn;
+  uint32_t i;
 
-  while (currConn != NULL) {
-    if (currConn->ip == ip_con) {
-      return currConn;
+  if (mapping->conn_table == NULL) {
+    for (conn = mapping->conns; conn != NULL; conn = conn->next) {
+      if (conn->ip == ip && conn->port == port) {
+        return conn;
+      }
     }
-    currConn = currConn->next;
+    return NULL;
   }
 
+  /* Linear probing, the table is never more than half full */
+  for (i = sr_nat_conn_hash(ip, port, mapping->conn_mask);
+       (conn = mapping->conn_table[i]) != NULL; i = (i + 1) & mapping->conn_mask) {
+    if (conn->ip == ip && conn->port == port) {
+      return conn;
+    }
+  }
   return NULL;
 }
 
-/* Insert a new connection associated with the given IP in the NAT entry. */
-struct sr_nat_connection *sr_nat_insert_tcp_con(struct sr_nat_mapping *mapping, uint32_t ip_con) {
-  struct sr_nat_connection *newConn = malloc(sizeof(struct sr_nat_connection));
-  assert(newConn != NULL);
+static void sr_nat_conn_table_put(struct sr_nat_mapping *mapping,
+  struct sr_nat_connection *conn) {
+  uint32_t i = sr_nat_conn_hash(conn->ip, conn->port, mapping->conn_mask);
+
+  while (mapping->conn_table[i] != NULL) {
+    i = (i + 1) & mapping->conn_mask;
+  }
+  mapping->conn_table[i] = conn;
+  conn->slot = i;
+}
+
+/* (Re)build the table with the given number of slots from the list. */
+static int sr_nat_conn_table_build(struct sr_nat_mapping *mapping, uint32_t slots) {
+  struct sr_nat_connection **table = calloc(slots, sizeof(struct sr_nat_connection *));
+  struct sr_nat_connection *conn;
+
+  if (table == NULL) {
+    return -1;
+  }
+  free(mapping->conn_table);
+  mapping->conn_table = table;
+  mapping->conn_mask = slots - 1;
+  for (conn = mapping->conns; conn != NULL; conn = conn->next) {
+    sr_nat_conn_table_put(mapping, conn);
+  }
+  return 0;
+}
+
+/* Remove a connection from the table by shifting the rest of its probe
+   run back, so no tombstones are needed. */
+static void sr_nat_conn_table_del(struct sr_nat_mapping *mapping,
+  struct sr_nat_connection *conn) {
+  uint32_t mask = mapping->conn_mask;
+  uint32_t hole = conn->slot;
+  uint32_t i = hole;
+  struct sr_nat_connection *next;
+
+  mapping->conn_table[hole] = NULL;
+  for (i = (i + 1) & mask; (next = mapping->conn_table[i]) != NULL; i = (i + 1) & mask) {
+    uint32_t home = sr_nat_conn_hash(next->ip, next->port, mask);
+
+    /* next may move into the hole only if its home slot is not between the
+       hole and where it sits now */
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      mapping->conn_table[hole] = next;
+      mapping->conn_table[i] = NULL;
+      next->slot = hole;
+      hole = i;
+    }
+  }
+}
+
+/* Get the connection with the given peer in the NAT entry. */
+struct sr_nat_connection *sr_nat_lookup_tcp_con(struct sr_nat *nat,
+  struct sr_nat_mapping *mapping, uint32_t ip_con, uint16_t aux_con) {
+  return sr_nat_conn_find(mapping, ip_con, aux_con);
+}
+
+/* Insert a new connection with the given peer in the NAT entry. */
+struct sr_nat_connection *sr_nat_insert_tcp_con(struct sr_nat *nat,
+  struct sr_nat_mapping *mapping, uint32_t ip_con, uint16_t aux_con) {
+  struct sr_nat_shard *shard = sr_nat_int_shard(nat, mapping->ip_int);
+  uint32_t slots;
+
+  struct sr_nat_connection *newConn = sr_pool_alloc(&(nat->conn_pool));
+  if (newConn == NULL) {
+    fprintf(stderr, "[NAT] Connection table full (%u entries)\n", nat->capacity);
+    return NULL;
+  }
   memset(newConn, 0, sizeof(struct sr_nat_connection));
 
   newConn->last_updated = time(NULL);
   newConn->ip = ip_con;
+  newConn->port = aux_con;
   newConn->tcp_state = CLOSED;
+  newConn->synced_state = -1;
+  newConn->mapping = mapping;
 
-  struct sr_nat_connection *currConn = mapping->conns;
-
+  newConn->prev = NULL;
+  newConn->next = mapping->conns;
+  if (mapping->conns != NULL) {
+    mapping->conns->prev = newConn;
+  }
   mapping->conns = newConn;
-  newConn->next = currConn;
+  mapping->nconns++;
+
+  /* Index the connections once there are enough of them, and keep the
+     table at most half full. If it cannot grow, drop it: the list still
+     works, and the next insert tries again. */
+  if (mapping->conn_table != NULL && 2 * mapping->nconns <= mapping->conn_mask + 1) {
+    sr_nat_conn_table_put(mapping, newConn);
+  } else if (mapping->nconns > SR_NAT_CONN_HASH_MIN) {
+    slots = mapping->conn_table != NULL ? 2 * (mapping->conn_mask + 1) : 4 * SR_NAT_CONN_HASH_MIN;
+    while (2 * mapping->nconns > slots) {
+      slots *= 2;
+    }
+    if (sr_nat_conn_table_build(mapping, slots) != 0) {
+      free(mapping->conn_table);
+      mapping->conn_table = NULL;
+    }
+  }
+
+  /* The connection now keeps the mapping alive */
+  sr_wheel_del(&(shard->wheel), &(mapping->timer));
+  sr_timer_init(&(newConn->timer), sr_nat_conn_expire, newConn);
+  sr_wheel_add(&(shard->wheel), &(newConn->timer), sr_nat_conn_deadline(nat, newConn));
 
   return newConn;
 }
 
-void check_tcp_conns(struct sr_nat *nat, struct sr_nat_mapping *nat_mapping) {
-  struct sr_nat_connection *currConn, *nextConn;
-  time_t curtime = time(NULL);
+/* Keep the host's half-open count in step with the state machine. */
+static void sr_nat_conn_sync_halfopen(struct sr_nat_connection *conn) {
+  int halfopen = conn->tcp_state == SYN_SENT || conn->tcp_state == SYN_RCVD;
 
-  currConn = nat_mapping->conns;
+  if (halfopen != conn->halfopen) {
+    if (halfopen) {
+      conn->mapping->host->nhalfopen++;
+    } else {
+      conn->mapping->host->nhalfopen--;
+    }
+    conn->halfopen = halfopen;
+  }
+}
 
-  while (currConn != NULL) {
-    nextConn = currConn->next;
-    /* print_tcp_state(currConn->tcp_state); */
+void sr_nat_update_tcp_con(struct sr_nat *nat, struct sr_nat_connection *conn) {
+  struct sr_nat_shard *shard = sr_nat_int_shard(nat, conn->mapping->ip_int);
 
-    if (currConn->tcp_state == ESTABLISHED) {
-      if (difftime(curtime, currConn->last_updated) > nat->tcp_idle_timeout) {
-        destroy_tcp_conn(nat_mapping, currConn);
-      }
+  conn->last_updated = time(NULL);
+  conn->mapping->last_updated = conn->last_updated;
+  sr_nat_conn_sync_halfopen(conn);
+  if (conn->tcp_state != conn->synced_state) {
+    conn->synced_state = conn->tcp_state;
+    sr_nat_sync_mark(nat, conn->mapping);
+  }
+  sr_wheel_add(&(shard->wheel), &(conn->timer), sr_nat_conn_deadline(nat, conn));
+}
+
+/* Bits of conn->fins */
+#define SR_NAT_FIN_INT        0x1 /* internal host sent its FIN */
+#define SR_NAT_FIN_INT_ACKED  0x2 /* and the peer acked it */
+#define SR_NAT_FIN_EXT        0x4
+#define SR_NAT_FIN_EXT_ACKED  0x8
+
+static void sr_nat_enter_time_wait(struct sr_nat_connection *conn) {
+  if (conn->tcp_state != TIME_WAIT) {
+    conn->tcp_state = TIME_WAIT;
+    conn->time_wait = time(NULL);
+  }
+}
+
+void sr_nat_track_close(struct sr_nat_connection *conn, sr_ip_hdr_t *ip_hdr, int outbound) {
+  sr_tcp_hdr_t *tcp_hdr = (sr_tcp_hdr_t *) ((uint8_t *) ip_hdr + ip_hdr->ip_hl * 4);
+  uint32_t payload = ntohs(ip_hdr->ip_len) - ip_hdr->ip_hl * 4 - (tcp_hdr->data_offset >> 4) * 4;
+  uint8_t fin = outbound ? SR_NAT_FIN_INT : SR_NAT_FIN_EXT;
+  uint8_t other = outbound ? SR_NAT_FIN_EXT : SR_NAT_FIN_INT;
+
+  if (tcp_hdr->rst) {
+    printf("[NAT TCP] RST, connection to TIME_WAIT\n");
+    sr_nat_enter_time_wait(conn);
+    return;
+  }
+
+  /* Only a synchronized connection can be closed */
+  switch (conn->tcp_state) {
+    case ESTABLISHED: case FIN_WAIT_1: case FIN_WAIT_2: case CLOSE_WAIT:
+    case CLOSING: case LAST_ACK:
+      break;
+    default:
+      return;
+  }
+
+  if (tcp_hdr->fin && !(conn->fins & fin)) {
+    conn->fins |= fin;
+    if (outbound) {
+      conn->int_fin = ntohl(tcp_hdr->seq) + payload;
     } else {
-      if (difftime(curtime, currConn->last_updated) > nat->transitory_idle_timeout) {
-        destroy_tcp_conn(nat_mapping, currConn);
-      }
+      conn->ext_fin = ntohl(tcp_hdr->seq) + payload;
     }
+  }
+  /* The FIN takes one sequence number, so its ack is one past it */
+  if (tcp_hdr->ack && (conn->fins & other) &&
+      ntohl(tcp_hdr->ack_num) == (outbound ? conn->ext_fin : conn->int_fin) + 1) {
+    conn->fins |= other << 1;
+  }
 
-    currConn = nextConn;
+  if ((conn->fins & SR_NAT_FIN_INT) && (conn->fins & SR_NAT_FIN_EXT)) {
+    if ((conn->fins & SR_NAT_FIN_INT_ACKED) && (conn->fins & SR_NAT_FIN_EXT_ACKED)) {
+      sr_nat_enter_time_wait(conn);
+    } else if (conn->fins & (SR_NAT_FIN_INT_ACKED | SR_NAT_FIN_EXT_ACKED)) {
+      conn->tcp_state = LAST_ACK;
+    } else {
+      conn->tcp_state = CLOSING;
+    }
+  } else if (conn->fins & SR_NAT_FIN_INT) {
+    conn->tcp_state = (conn->fins & SR_NAT_FIN_INT_ACKED) ? FIN_WAIT_2 : FIN_WAIT_1;
+  } else if (conn->fins & SR_NAT_FIN_EXT) {
+    conn->tcp_state = CLOSE_WAIT;
   }
 }
 
-void destroy_tcp_conn(struct sr_nat_mapping *mapping, struct sr_nat_connection *conn) {
-  printf("[REMOVE] TCP connection\n");
-  struct sr_nat_connection *prevConn = mapping->conns;
+void sr_nat_reopen_tcp_con(struct sr_nat_connection *conn) {
+  conn->tcp_state = CLOSED;
+  conn->fins = 0;
+}
 
-  if (prevConn != NULL) {
-    if (prevConn == conn) {
-      mapping->conns = conn->next;
-    } else {
-      for (; prevConn->next != NULL && prevConn->next != conn; prevConn = prevConn->next) {}
-        if (prevConn == NULL) { return; }
-      prevConn->next = conn->next;
+void sr_nat_track_hairpin(struct sr_nat_connection *conn, sr_ip_hdr_t *ip_hdr, int outbound) {
+  sr_tcp_hdr_t *tcp_hdr = (sr_tcp_hdr_t *) ((uint8_t *) ip_hdr + ip_hdr->ip_hl * 4);
+
+  if (tcp_hdr->syn && !tcp_hdr->rst) {
+    if (!tcp_hdr->ack) {
+      if (conn->tcp_state == TIME_WAIT) {
+        sr_nat_reopen_tcp_con(conn);
+      }
+      if (conn->tcp_state == CLOSED) {
+        conn->tcp_state = SYN_SENT;
+      }
+    } else if (conn->tcp_state == SYN_SENT) {
+      conn->tcp_state = SYN_RCVD;
     }
-    free(conn);
+    return;
+  }
+  if (tcp_hdr->ack && !tcp_hdr->rst && conn->tcp_state == SYN_RCVD) {
+    conn->tcp_state = ESTABLISHED;
+  }
+  sr_nat_track_close(conn, ip_hdr, outbound);
+}
+
+void destroy_tcp_conn(struct sr_nat *nat, struct sr_nat_connection *conn) {
+  printf("[REMOVE] TCP connection\n");
+  struct sr_nat_mapping *mapping = conn->mapping;
+  struct sr_nat_shard *shard = sr_nat_int_shard(nat, mapping->ip_int);
+
+  if (conn->prev != NULL) {
+    conn->prev->next = conn->next;
+  } else {
+    mapping->conns = conn->next;
+  }
+  if (conn->next != NULL) {
+    conn->next->prev = conn->prev;
+  }
+  if (mapping->conn_table != NULL) {
+    sr_nat_conn_table_del(mapping, conn);
+  }
+  mapping->nconns--;
+  if (conn->halfopen) {
+    mapping->host->nhalfopen--;
+  }
+
+  sr_wheel_del(&(shard->wheel), &(conn->timer));
+  sr_pool_free(&(nat->conn_pool), conn);
+
+  /* Last connection gone, the mapping times out on its own now */
+  if (mapping->conns == NULL) {
+    sr_wheel_add(&(shard->wheel), &(mapping->timer), sr_nat_mapping_deadline(nat, mapping));
   }
 }
 
 void destroy_nat_mapping(struct sr_nat *nat, struct sr_nat_mapping *nat_mapping) {
   printf("[REMOVE] nat mapping\n");
+  struct sr_nat_shard *shard = sr_nat_int_shard(nat, nat_mapping->ip_int);
+
+  sr_nat_sync_mark(nat, nat_mapping);
+
+  sr_nat_unlink_mapping(shard, nat_mapping);
+  sr_wheel_del(&(shard->wheel), &(nat_mapping->timer));
+  if (nat->block_size > 0) {
+    sr_portalloc_release(&(nat_mapping->host->block_ports[nat_mapping->type]),
+                         ntohs(nat_mapping->aux_ext));
+  } else {
+    sr_nat_return_port(nat, nat_mapping->host->addr, nat_mapping->type,
+                       ntohs(nat_mapping->aux_ext));
+  }
+
+  struct sr_nat_connection *currConn, *nextConn;
+  currConn = nat_mapping->conns;
+
+  while (currConn != NULL) {
+    nextConn = currConn->next;
+    sr_wheel_del(&(shard->wheel), &(currConn->timer));
+    sr_pool_free(&(nat->conn_pool), currConn);
+    currConn = nextConn;
+  }
+  free(nat_mapping->conn_table);
+  nat_mapping->conn_table = NULL;
+
+  nat_mapping->host->nmappings--;
+  nat_mapping->host->ntype[nat_mapping->type]--;
+  sr_nat_put_host(shard, nat_mapping->host);
+
+  /* Pooled memory is never given back, so stale handles can still read
+     the generation */
+  nat_mapping->generation++;
+  sr_pool_free(&(nat->mapping_pool), nat_mapping);
+}
+
+int sr_nat_park_syn(struct sr_nat *nat, uint8_t *packet, unsigned int len, char *iface) {
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t));
+  sr_tcp_hdr_t *tcp_hdr;
+  struct sr_nat_shard *shard;
+  struct sr_nat_syn *syn;
+
+  /* The whole ip and tcp headers, which also covers what is quoted back */
+  if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) || ip_hdr->ip_hl < 5 ||
+      len < sizeof(sr_ethernet_hdr_t) + ip_hdr->ip_hl * 4 + sizeof(sr_tcp_hdr_t)) {
+    printf("[NAT TCP] Truncated SYN, not parking it\n");
+    return -1;
+  }
+  tcp_hdr = (sr_tcp_hdr_t *) ((uint8_t *) ip_hdr + ip_hdr->ip_hl * 4);
+  shard = sr_nat_syn_shard(nat, tcp_hdr->dst_port);
+
+  pthread_mutex_lock(&(shard->lock));
+  pthread_mutex_lock(&(shard->syn_lock));
+
+  /* A retransmission of a SYN we already hold keeps the first deadline */
+  for (syn = shard->parked_syns; syn != NULL; syn = syn->next) {
+    if (syn->aux_ext == tcp_hdr->dst_port && syn->ip_peer == ip_hdr->ip_src &&
+        syn->aux_peer == tcp_hdr->src_port) {
+      pthread_mutex_unlock(&(shard->syn_lock));
+      pthread_mutex_unlock(&(shard->lock));
+      return 0;
+    }
+  }
+
+  syn = shard->free_syns;
+  if (syn == NULL) {
+    pthread_mutex_unlock(&(shard->syn_lock));
+    pthread_mutex_unlock(&(shard->lock));
+    return -1;
+  }
+  shard->free_syns = syn->next;
+
+  syn->cancelled = 0;
+  syn->aux_ext = tcp_hdr->dst_port;
+  syn->ip_peer = ip_hdr->ip_src;
+  syn->aux_peer = tcp_hdr->src_port;
+  strncpy(syn->iface, iface, sr_IFACE_NAMELEN - 1);
+  syn->iface[sr_IFACE_NAMELEN - 1] = '\0';
+  memcpy(syn->packet, packet, sizeof(syn->packet));
+
+  syn->prev = NULL;
+  syn->next = shard->parked_syns;
+  if (shard->parked_syns != NULL) {
+    shard->parked_syns->prev = syn;
+  }
+  shard->parked_syns = syn;
+
+  sr_timer_init(&(syn->timer), sr_nat_syn_expire, syn);
+  sr_wheel_add(&(shard->wheel), &(syn->timer), time(NULL) + SR_NAT_SYN_TIMEOUT);
 
-  struct sr_nat_mapping *prevMapping = nat->mappings;
+  pthread_mutex_unlock(&(shard->syn_lock));
+  pthread_mutex_unlock(&(shard->lock));
+  return 0;
+}
+
+void sr_nat_cancel_syn(struct sr_nat *nat, struct sr_nat_mapping *mapping,
+  uint32_t ip_peer, uint16_t aux_peer) {
+  /* Usually not the mapping's shard, whose lock we hold: only take the
+     queue's own lock, and leave the timer to give the slot back */
+  struct sr_nat_shard *shard = sr_nat_syn_shard(nat, mapping->aux_ext);
+  struct sr_nat_syn *syn;
+
+  pthread_mutex_lock(&(shard->syn_lock));
+  for (syn = shard->parked_syns; syn != NULL; syn = syn->next) {
+    if (syn->aux_ext == mapping->aux_ext && syn->ip_peer == ip_peer && syn->aux_peer == aux_peer) {
+      printf("[NAT TCP] Outbound SYN matches a parked one, dropping it silently\n");
+      sr_nat_unpark_syn(shard, syn);
+      syn->cancelled = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&(shard->syn_lock));
+}
+
+void sr_nat_export_mapping(struct sr_nat_mapping *mapping, struct sr_nat_snap_mapping *m) {
+  memset(m, 0, sizeof(*m));
+  m->ip_int = mapping->ip_int;
+  m->ip_ext = mapping->ip_ext;
+  m->aux_int = mapping->aux_int;
+  m->aux_ext = mapping->aux_ext;
+  m->type = mapping->type;
+  m->nconns = mapping->nconns;
+  m->last_updated = mapping->last_updated;
+}
+
+void sr_nat_export_conn(struct sr_nat_connection *conn, struct sr_nat_snap_conn *c) {
+  memset(c, 0, sizeof(*c));
+  c->ip = conn->ip;
+  c->port = conn->port;
+  c->tcp_state = conn->tcp_state;
+  c->fins = conn->fins;
+  c->client_isn = conn->client_isn;
+  c->server_isn = conn->server_isn;
+  c->int_fin = conn->int_fin;
+  c->ext_fin = conn->ext_fin;
+  c->last_updated = conn->last_updated;
+  c->time_wait = conn->time_wait;
+}
+
+void sr_nat_walk(struct sr_nat *nat, void (*fn)(void *ctx, struct sr_nat_mapping *mapping),
+  void *ctx) {
+  struct sr_nat_mapping *mapping, *next;
+  int i;
+
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+
+    pthread_mutex_lock(&(shard->lock));
+    for (mapping = shard->mappings; mapping != NULL; mapping = next) {
+      next = mapping->next;
+      fn(ctx, mapping);
+    }
+    pthread_mutex_unlock(&(shard->lock));
+  }
+}
+
+void sr_nat_peek(struct sr_nat *nat, uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type,
+  void (*fn)(void *ctx, struct sr_nat_mapping *mapping), void *ctx) {
+  struct sr_nat_shard *shard = sr_nat_int_shard(nat, ip_int);
+
+  pthread_mutex_lock(&(shard->lock));
+  fn(ctx, sr_nat_find_internal(shard, ip_int, aux_int, type));
+  pthread_mutex_unlock(&(shard->lock));
+}
+
+/* Snapshot being written by sr_nat_save */
+struct sr_nat_save_ctx {
+  FILE *f;
+  struct sr_nat_snap_hdr hdr;
+};
+
+static void sr_nat_save_mapping(void *ctx_ptr, struct sr_nat_mapping *mapping) {
+  struct sr_nat_save_ctx *ctx = (struct sr_nat_save_ctx *) ctx_ptr;
+  struct sr_nat_snap_mapping m;
+  struct sr_nat_snap_conn c;
+  struct sr_nat_connection *conn;
+
+  sr_nat_export_mapping(mapping, &m);
+  fwrite(&m, sizeof(m), 1, ctx->f);
+  for (conn = mapping->conns; conn != NULL; conn = conn->next) {
+    sr_nat_export_conn(conn, &c);
+    fwrite(&c, sizeof(c), 1, ctx->f);
+  }
+  ctx->hdr.nmappings++;
+  ctx->hdr.nconns += mapping->nconns;
+}
+
+int sr_nat_save(struct sr_nat *nat) {
+  struct sr_nat_save_ctx ctx;
+  char tmp[256];
+
+  if (nat->snapshot == NULL) {
+    return -1;
+  }
+  pthread_mutex_lock(&(nat->save_lock));
+  snprintf(tmp, sizeof(tmp), "%s.tmp", nat->snapshot);
+  ctx.f = fopen(tmp, "wb");
+  if (ctx.f == NULL) {
+    fprintf(stderr, "[NAT] Cannot write snapshot %s: %s\n", tmp, strerror(errno));
+    pthread_mutex_unlock(&(nat->save_lock));
+    return -1;
+  }
+
+  /* The counts go in once everything is written */
+  memset(&(ctx.hdr), 0, sizeof(ctx.hdr));
+  memcpy(ctx.hdr.magic, SR_NAT_SNAPSHOT_MAGIC, sizeof(ctx.hdr.magic));
+  ctx.hdr.version = SR_NAT_SNAPSHOT_VERSION;
+  ctx.hdr.mapping_size = sizeof(struct sr_nat_snap_mapping);
+  ctx.hdr.conn_size = sizeof(struct sr_nat_snap_conn);
+  ctx.hdr.saved = time(NULL);
+  fwrite(&(ctx.hdr), sizeof(ctx.hdr), 1, ctx.f);
+
+  sr_nat_walk(nat, sr_nat_save_mapping, &ctx);
+
+  fseek(ctx.f, 0, SEEK_SET);
+  fwrite(&(ctx.hdr), sizeof(ctx.hdr), 1, ctx.f);
+  if (ferror(ctx.f) | fclose(ctx.f) || rename(tmp, nat->snapshot) != 0) {
+    fprintf(stderr, "[NAT] Cannot write snapshot %s: %s\n", tmp, strerror(errno));
+    remove(tmp);
+    pthread_mutex_unlock(&(nat->save_lock));
+    return -1;
+  }
+  pthread_mutex_unlock(&(nat->save_lock));
+
+  printf("[NAT] Saved %u mappings, %u connections to %s\n",
+         ctx.hdr.nmappings, ctx.hdr.nconns, nat->snapshot);
+  return 0;
+}
 
-  if (prevMapping != NULL) {
-    if (prevMapping == nat_mapping) {
-      nat->mappings = nat_mapping->next;
+int sr_nat_load_mapping(struct sr_nat *nat, const struct sr_nat_snap_mapping *m,
+  const struct sr_nat_snap_conn *c) {
+  struct sr_nat_shard *shard = sr_nat_int_shard(nat, m->ip_int);
+  struct sr_nat_host *host;
+  struct sr_nat_mapping *mapping;
+  struct sr_nat_connection *conn;
+  int addr = sr_nat_addr_index(nat, m->ip_ext);
+  uint32_t i;
+  int reserved;
+
+  if (m->type >= NAT_MAPPING_TYPES || addr < 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&(shard->lock));
+  mapping = sr_nat_find_internal(shard, m->ip_int, m->aux_int, m->type);
+  if (mapping != NULL) {
+    destroy_nat_mapping(nat, mapping);
+  }
+
+  host = sr_nat_get_host(shard, m->ip_int, addr);
+  if (host == NULL) {
+    pthread_mutex_unlock(&(shard->lock));
+    return -1;
+  }
+  mapping = sr_pool_alloc(&(nat->mapping_pool));
+  reserved = -1;
+  if (host->addr == addr && mapping != NULL) {
+    /* In deterministic mode the port must still be in the host's block */
+    if (nat->block_size > 0) {
+      reserved = sr_portalloc_reserve(&(host->block_ports[m->type]), ntohs(m->aux_ext));
     } else {
-      for (; prevMapping->next != NULL && prevMapping->next != nat_mapping; prevMapping = prevMapping->next) {}
-        if (prevMapping == NULL) {return;}
-      prevMapping->next = nat_mapping->next;
+      reserved = sr_nat_reserve_port(nat, shard, addr, m->type, ntohs(m->aux_ext));
+    }
+  }
+  if (reserved != 0) {
+    if (mapping != NULL) {
+      sr_pool_free(&(nat->mapping_pool), mapping);
     }
+    sr_nat_put_host(shard, host);
+    pthread_mutex_unlock(&(shard->lock));
+    return -1;
+  }
+  sr_nat_fill_mapping(shard, mapping, host, m->ip_int, m->aux_int, m->ip_ext,
+                      m->aux_ext, m->type, (time_t) m->last_updated);
 
-    if (nat_mapping->type == nat_mapping_icmp) { /* ICMP */
-      nat->ports[nat_mapping->aux_ext] = 0;
-    } else if (nat_mapping->type == nat_mapping_tcp) { /* TCP */
-      nat->ports[nat_mapping->aux_ext] = 0;
+  for (i = 0; i < m->nconns; i++) {
+    conn = sr_nat_insert_tcp_con(nat, mapping, c[i].ip, c[i].port);
+    if (conn == NULL) {
+      break;
     }
+    conn->tcp_state = c[i].tcp_state;
+    conn->fins = c[i].fins;
+    conn->client_isn = c[i].client_isn;
+    conn->server_isn = c[i].server_isn;
+    conn->int_fin = c[i].int_fin;
+    conn->ext_fin = c[i].ext_fin;
+    conn->last_updated = c[i].last_updated;
+    conn->time_wait = c[i].time_wait;
+    conn->synced_state = conn->tcp_state;
+    sr_nat_conn_sync_halfopen(conn);
+    sr_wheel_add(&(shard->wheel), &(conn->timer), sr_nat_conn_deadline(nat, conn));
+  }
+  pthread_mutex_unlock(&(shard->lock));
+  return 0;
+}
 
-    struct sr_nat_connection *currConn, *nextConn;
-    currConn = nat_mapping->conns;
+void sr_nat_unload_mapping(struct sr_nat *nat, uint32_t ip_int, uint16_t aux_int,
+  sr_nat_mapping_type type) {
+  struct sr_nat_shard *shard = sr_nat_int_shard(nat, ip_int);
+  struct sr_nat_mapping *mapping;
+
+  pthread_mutex_lock(&(shard->lock));
+  mapping = sr_nat_find_internal(shard, ip_int, aux_int, type);
+  if (mapping != NULL) {
+    destroy_nat_mapping(nat, mapping);
+  }
+  pthread_mutex_unlock(&(shard->lock));
+}
+
+void sr_nat_clear(struct sr_nat *nat) {
+  int i;
 
-    while (currConn != NULL) {
-      nextConn = currConn->next;
-      free(currConn);
-      currConn = nextConn;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+
+    pthread_mutex_lock(&(shard->lock));
+    while (shard->mappings != NULL) {
+      destroy_nat_mapping(nat, shard->mappings);
+    }
+    pthread_mutex_unlock(&(shard->lock));
+  }
+}
+
+int sr_nat_restore(struct sr_nat *nat) {
+  const struct sr_nat_snap_hdr *hdr;
+  const struct sr_nat_snap_mapping *m;
+  const char *p, *end;
+  struct stat st;
+  void *base;
+  int fd, restored = 0, skipped = 0;
+  uint32_t i;
+
+  fd = open(nat->snapshot, O_RDONLY);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    fprintf(stderr, "[NAT] Cannot read snapshot %s: %s\n", nat->snapshot, strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct sr_nat_snap_hdr)) {
+    fprintf(stderr, "[NAT] Snapshot %s is truncated, ignoring it\n", nat->snapshot);
+    close(fd);
+    return -1;
+  }
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "[NAT] Cannot map snapshot %s: %s\n", nat->snapshot, strerror(errno));
+    return -1;
+  }
+  madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+  hdr = (const struct sr_nat_snap_hdr *) base;
+  end = (const char *) base + st.st_size;
+  if (memcmp(hdr->magic, SR_NAT_SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != SR_NAT_SNAPSHOT_VERSION ||
+      hdr->mapping_size != sizeof(struct sr_nat_snap_mapping) ||
+      hdr->conn_size != sizeof(struct sr_nat_snap_conn) ||
+      (uint64_t) st.st_size != sizeof(struct sr_nat_snap_hdr) +
+        (uint64_t) hdr->nmappings * hdr->mapping_size + (uint64_t) hdr->nconns * hdr->conn_size) {
+    fprintf(stderr, "[NAT] Snapshot %s is not a version %d snapshot, ignoring it\n",
+            nat->snapshot, SR_NAT_SNAPSHOT_VERSION);
+    munmap(base, st.st_size);
+    return -1;
+  }
+
+  p = (const char *) (hdr + 1);
+  for (i = 0; i < hdr->nmappings; i++) {
+    m = (const struct sr_nat_snap_mapping *) p;
+    p += sizeof(*m);
+    if (p > end || (uint64_t) m->nconns * sizeof(struct sr_nat_snap_conn) > (uint64_t) (end - p)) {
+      break;
     }
-    free(nat_mapping);
+    if (sr_nat_load_mapping(nat, m, (const struct sr_nat_snap_conn *) p) == 0) {
+      restored++;
+    } else {
+      skipped++;
+    }
+    p += m->nconns * sizeof(struct sr_nat_snap_conn);
   }
+  munmap(base, st.st_size);
+
+  printf("[NAT] Restored %d mappings from %s (%d skipped)\n", restored, nat->snapshot, skipped);
+  return restored;
 }
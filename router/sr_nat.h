@@ -5,16 +5,84 @@
 #define NAT_EXTERNAL_INTERFACE "eth2"
 #define TOTAL_PORTS 65535
 #define MIN_PORT 1024
+/* Start each port search at a random point instead of next-fit */
+#define SR_NAT_RANDOM_PORTS 0
+
+/* The table is split into independently locked shards. A mapping lives in
+   the shard picked by a hash of its internal host. External ports p with
+   p % SR_NAT_SHARDS == shard belong to a shard, which hands them out to
+   its own mappings first; once they run out it borrows from the other
+   shards, so one host can still use the whole port range. The shard
+   holding the mapping of each port is recorded in nat->port_shard.
+   Code that needs two shards at once (hairpinning) locks the one with
+   the lower index first. */
+#define SR_NAT_SHARD_BITS 4
+#define SR_NAT_SHARDS (1 << SR_NAT_SHARD_BITS)
+
+/* Number of mappings, and of connections, the table holds when
+   nat->capacity is not set before sr_nat_init */
+#define SR_NAT_DEFAULT_CAPACITY 32768
+/* Seconds between two reports of table usage */
+#define SR_NAT_REPORT_INTERVAL 60
+
+/* Unsolicited inbound SYNs are held this many seconds before they are
+   answered with port unreachable (RFC 5382 REQ-4), at most
+   SR_NAT_SYN_QUEUE of them per shard */
+#define SR_NAT_SYN_TIMEOUT 6
+#define SR_NAT_SYN_QUEUE 64
+
+/* Deterministic mode (nat->block_size > 0): every internal host owns a
+   fixed block of block_size external ports on a fixed external address,
+   both computed from its address (see sr_nat_port_block). Shards then
+   follow the block number instead, so both sides of a mapping still
+   find their shard without a lookup. */
+#define SR_NAT_PORT_RANGE (TOTAL_PORTS - MIN_PORT + 1)
+
+/* Seconds a closed or reset TCP connection is held in TIME_WAIT so late
+   segments still find it, before its port can go back to the allocator.
+   Not scaled with table pressure. */
+#define SR_NAT_TIME_WAIT 30
+
+/* Snapshot file format, see sr_nat_save. Value of nat->snapshot_request. */
+#define SR_NAT_SNAPSHOT_VERSION 1
+#define SR_NAT_SNAPSHOT_SAVE 1
+
+/* Adaptive timeouts: above the low watermark (percent of the mapping,
+   connection or port capacity in use) the idle timeouts shrink linearly,
+   in steps of SR_NAT_SCALE_STEP percent, down to SR_NAT_SCALE_MIN percent
+   at the high watermark. */
+#define SR_NAT_LOW_WATERMARK 70
+#define SR_NAT_HIGH_WATERMARK 90
+#define SR_NAT_SCALE_MIN 10
+#define SR_NAT_SCALE_STEP 10
+
+/* External addresses the nat can hand out, see struct sr_nat_addr */
+#define SR_NAT_MAX_ADDRS 64
+/* Buckets in each shard's internal host table (power of two) */
+#define SR_NAT_HOST_HASH_SIZE 256
+
+/* Connections a mapping keeps in a plain list before it indexes them */
+#define SR_NAT_CONN_HASH_MIN 8
+
+/* Buckets in each of a shard's mapping hash indexes (power of two) */
+#define SR_NAT_HASH_BITS 10
+#define SR_NAT_HASH_SIZE (1 << SR_NAT_HASH_BITS)
 
 #include <inttypes.h>
 #include <time.h>
 #include <pthread.h>
+#include <signal.h>
+#include "sr_protocol.h"
+#include "sr_pool.h"
+#include "sr_portalloc.h"
+#include "sr_timerwheel.h"
 
 typedef enum {
   nat_mapping_icmp,
-  nat_mapping_tcp
-  /* nat_mapping_udp, */
+  nat_mapping_tcp,
+  nat_mapping_udp
 } sr_nat_mapping_type;
+#define NAT_MAPPING_TYPES 3
 
 typedef enum {
   CLOSE_WAIT,
@@ -32,13 +100,24 @@ typedef enum {
 
 struct sr_nat_connection {
   /* add TCP connection state data members here */
-  uint32_t ip;
+  uint32_t ip; /* peer address */
+  uint16_t port; /* peer port */
   uint32_t client_isn;
   uint32_t server_isn;
   time_t last_updated;
   sr_tcp_state tcp_state;
 
-  struct sr_nat_connection *next;
+  struct sr_nat_mapping *mapping; /* mapping this connection belongs to */
+  struct sr_timer timer; /* idle timeout, see sr_nat_conn_expire */
+  uint32_t slot; /* index in mapping->conn_table, if there is one */
+  int halfopen; /* counted in the host's nhalfopen */
+  /* Teardown, see sr_nat_track_close: which FINs were seen and acked,
+     the sequence number of each side's FIN and when TIME_WAIT began */
+  uint8_t fins;
+  uint32_t int_fin, ext_fin;
+  time_t time_wait;
+  int synced_state; /* tcp_state last sent to the standby, -1 for none */
+  struct sr_nat_connection *next, *prev;
 };
 
 
@@ -50,16 +129,221 @@ struct sr_nat_mapping {
   uint16_t aux_int; /* internal port or icmp id */
   uint16_t aux_ext; /* external port or icmp id */
   time_t last_updated; /* use to timeout mappings */
+  time_t synced; /* last sent to the standby, see sr_nat_touch */
+  uint32_t generation; /* bumped each time the mapping is destroyed */
   struct sr_nat_connection *conns; /* list of connections. null for ICMP */
+  /* Once a mapping has more than SR_NAT_CONN_HASH_MIN connections they are
+     also indexed by (peer ip, peer port) in this open addressing table of
+     conn_mask + 1 slots, see sr_nat_conn_find */
+  uint32_t nconns;
+  uint32_t conn_mask;
+  struct sr_nat_connection **conn_table;
+  struct sr_nat_host *host; /* internal host, holds its external address */
+  struct sr_timer timer; /* idle timeout, see sr_nat_mapping_expire */
   struct sr_nat_mapping *next;
+  struct sr_nat_mapping *prev;
+
+  /* chains in the internal (type, ip_int, aux_int) and
+     external (type, ip_ext, aux_ext) hash indexes */
+  struct sr_nat_mapping *int_next, *int_prev;
+  struct sr_nat_mapping *ext_next, *ext_prev;
+};
+
+/* A reference to a mapping that can be kept after its shard lock is
+   dropped. Mappings come from a pool that is never freed while the nat is
+   up, so the generation tells a stale handle from a live one. */
+struct sr_nat_handle {
+  struct sr_nat_mapping *mapping;
+  uint32_t generation;
+  int shard;
+};
+
+/* An unsolicited SYN waiting for its deadline. Keeps what sendICMPmessage
+   needs: the ethernet header and the start of the ip packet. */
+struct sr_nat_syn {
+  uint16_t aux_ext; /* external port the SYN was sent to */
+  uint32_t ip_peer; /* sender */
+  uint16_t aux_peer;
+  char iface[sr_IFACE_NAMELEN]; /* where it came in */
+  uint8_t packet[sizeof(sr_ethernet_hdr_t) + ICMP_DATA_SIZE];
+  struct sr_timer timer;
+  int cancelled; /* off the parked list, waiting for its timer to go off */
+  struct sr_nat_syn *next, *prev;
+};
+
+/* One external address. Addresses with the same number of paired hosts
+   share a load bucket, buckets are kept in increasing order, so the least
+   loaded address is the first one of the first bucket. */
+struct sr_nat_load;
+struct sr_nat_addr {
+  uint32_t ip; /* 0 until configured: the outgoing interface's address */
+  uint32_t hosts; /* internal hosts paired with this address */
+  struct sr_nat_load *load;
+  struct sr_nat_addr *next, *prev; /* in the load bucket */
+};
+
+struct sr_nat_load {
+  uint32_t hosts;
+  struct sr_nat_addr *addrs;
+  struct sr_nat_load *next, *prev;
+};
+
+/* An internal host with mappings. Paired pooling: all mappings of a host
+   use the same external address while it has any. */
+struct sr_nat_host {
+  uint32_t ip_int;
+  int addr; /* index in nat->addrs */
+  uint32_t nmappings;
+  uint32_t ntype[NAT_MAPPING_TYPES]; /* mappings of each type, for quotas */
+  uint32_t nhalfopen; /* TCP connections in SYN_SENT or SYN_RCVD */
+  struct sr_nat_host *next, *prev; /* hash chain */
+
+  /* Deterministic mode only: the host's own port block */
+  uint32_t block;
+  struct sr_portalloc block_ports[NAT_MAPPING_TYPES];
+  int exhausted; /* exhaustion already reported */
+};
+
+/* Snapshot file: a header, then each mapping followed by its connections,
+   all fixed-size records. Fields are in host byte order (addresses and
+   ports in network order, as in the table), so a snapshot is only meant
+   for a restart on the same machine. It is read straight from an mmap.
+   Replication (sr_natsync.h) sends the same mapping and connection
+   records. */
+#define SR_NAT_SNAPSHOT_MAGIC "srnatsnp"
+
+struct sr_nat_snap_hdr {
+  char magic[8];
+  uint32_t version;
+  uint32_t mapping_size; /* record sizes, a cheap layout check */
+  uint32_t conn_size;
+  uint32_t nmappings;
+  uint32_t nconns;
+  uint32_t pad;
+  int64_t saved;
+};
+
+struct sr_nat_snap_mapping {
+  uint32_t ip_int;
+  uint32_t ip_ext;
+  uint16_t aux_int;
+  uint16_t aux_ext;
+  uint32_t type;
+  uint32_t nconns; /* connection records that follow */
+  uint32_t pad;
+  int64_t last_updated;
+};
+
+struct sr_nat_snap_conn {
+  uint32_t ip;
+  uint16_t port;
+  uint8_t tcp_state;
+  uint8_t fins;
+  uint32_t client_isn;
+  uint32_t server_isn;
+  uint32_t int_fin;
+  uint32_t ext_fin;
+  uint32_t pad;
+  int64_t last_updated;
+  int64_t time_wait;
+};
+
+struct sr_nat;
+struct sr_natsync;
+
+struct sr_nat_shard {
+  struct sr_nat *nat;
+  pthread_mutex_t lock;
+
+  struct sr_nat_mapping *mappings;
+
+  /* Hash indexes over mappings, see sr_nat_int_hash/sr_nat_ext_hash */
+  struct sr_nat_mapping *int_index[SR_NAT_HASH_SIZE];
+  struct sr_nat_mapping *ext_index[SR_NAT_HASH_SIZE];
+
+  /* Internal hosts of this shard, by ip_int */
+  struct sr_nat_host *hosts[SR_NAT_HOST_HASH_SIZE];
+
+  /* External ports (or ICMP ids) of this shard available for new
+     mappings, one pool per address and mapping type, see sr_nat_ports.
+     Guarded by port_lock rather than lock, since other shards borrow from
+     them. Nothing else is locked while a port_lock is held, and only one
+     port_lock at a time. */
+  struct sr_portalloc *ports;
+  pthread_mutex_t port_lock;
+
+  /* Expiry of mappings and connections, advanced by sr_nat_timeout */
+  struct sr_wheel wheel;
+
+  /* Unsolicited SYNs to ports of this shard (see sr_nat_syn_shard), even
+     once another shard's mapping borrows the port. Due ones move to ready
+     and are answered by sr_nat_timeout once the shard is unlocked. The
+     lists are guarded by syn_lock, taken last like port_lock, so a
+     mapping of any shard can cancel a SYN; timers by the shard lock. */
+  struct sr_nat_syn syns[SR_NAT_SYN_QUEUE];
+  struct sr_nat_syn *free_syns, *parked_syns, *ready_syns;
+  pthread_mutex_t syn_lock;
 };
 
 struct sr_nat {
   /* add any fields here */
-  struct sr_nat_mapping *mappings;
+  struct sr_nat_shard shards[SR_NAT_SHARDS];
+
+  /* Preallocated mappings and connections */
+  uint32_t capacity;
+  struct sr_pool mapping_pool;
+  struct sr_pool conn_pool;
+  time_t last_report;
+
+  /* External address pool. Fill in addrs[].ip and naddrs before
+     sr_nat_init; with no addresses the outgoing interface's is used. */
+  int naddrs;
+  struct sr_nat_addr addrs[SR_NAT_MAX_ADDRS];
+  struct sr_nat_load loads[SR_NAT_MAX_ADDRS];
+  struct sr_nat_load *least, *free_loads;
+  pthread_mutex_t addr_lock;
+  struct sr_pool host_pool;
+
+  /* Deterministic port blocks, off when block_size is 0. Set block_size
+     before sr_init. block_owner has the internal host holding each
+     (address, block), 0 when free, and is guarded by the block's shard. */
+  uint32_t block_size;
+  uint32_t nblocks;
+  uint32_t *block_owner;
+
+  /* Dynamic mode: shard holding the mapping of each external port, by
+     address, type and port, see sr_nat_ext_shard. Written under the
+     port_lock of the port's own shard. */
+  uint8_t *port_shard;
+
+  /* Per internal host limits, 0 for none: mappings of each type and
+     half-open TCP connections. Set before sr_init. */
+  uint32_t quota[NAT_MAPPING_TYPES];
+  uint32_t halfopen_quota;
+
+  /* Watermarks in percent, set before sr_init (0 for the defaults).
+     timeout_scale is the percentage of the configured timeouts in
+     effect, only written by the timeout thread and reported with the
+     table usage. */
+  uint32_t low_watermark;
+  uint32_t high_watermark;
+  uint32_t timeout_scale;
+  uint32_t occupancy;
+
+  /* Snapshot file, NULL for none. Set before sr_init, which restores it.
+     The SIGUSR1 handler sets snapshot_request and the timeout thread does
+     the saving; save_lock keeps that from overlapping the save main does
+     on the way out. */
+  const char *snapshot;
+  volatile sig_atomic_t snapshot_request;
+  pthread_mutex_t save_lock;
+
+  /* Replication, see sr_natsync.h. On a standby mappings do not expire,
+     the active instance sends their deletion. */
+  struct sr_natsync *sync;
+  volatile int standby;
 
   /* threading */
-  pthread_mutex_t lock;
   pthread_mutexattr_t attr;
   pthread_attr_t thread_attr;
   pthread_t thread;
@@ -68,10 +352,8 @@ struct sr_nat {
   int icmp_timeout_int;
   int tcp_idle_timeout;
   int transitory_idle_timeout;
+  int udp_idle_timeout;
   struct sr_instance* sr;
-
-  /* Ports available to use for new mapping */
-  uint16_t ports[TOTAL_PORTS];
 };
 
 
@@ -80,26 +362,141 @@ int   sr_nat_destroy(struct sr_nat *nat);  /* Destroys the nat (free memory) */
 void *sr_nat_timeout(void *nat_ptr);  /* Periodic Timout */
 int is_nat_internal_iface(char *iface);
 int is_nat_external_iface(char *iface);
-int generate_unique_port(struct sr_nat *nat);
-/* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
+/* Generate an external port on the host's external address for a new
+   mapping of the host. Caller must hold the host's shard. */
+int generate_unique_port(struct sr_nat *nat, struct sr_nat_host *host, sr_nat_mapping_type type);
+/* Deterministic mode: the external address (0 for the outgoing
+   interface's) and port range [first, last] of ip_int, computed without
+   touching the table. Returns -1 if the nat is not in that mode. */
+int sr_nat_port_block(struct sr_nat *nat, uint32_t ip_int, uint32_t *ip_ext,
+  uint16_t *first, uint16_t *last);
+/* Whether ip_int has reached its quota of type mappings, which is why
+   sr_nat_acquire_new refused it. */
+int sr_nat_over_quota(struct sr_nat *nat, uint32_t ip_int, sr_nat_mapping_type type);
+/* Whether the host of an acquired mapping may not open another TCP
+   connection. */
+int sr_nat_halfopen_full(struct sr_nat *nat, struct sr_nat_mapping *mapping);
+/* Whether ip is one of the configured external addresses. */
+int sr_nat_is_external_addr(struct sr_nat *nat, uint32_t ip);
+
+/* Zero-copy lookups. These return the table's own mapping with its shard
+   locked, or NULL with nothing locked. The caller may read and update the
+   mapping and its connections until it calls sr_nat_release_mapping. */
+struct sr_nat_mapping *sr_nat_acquire_external(struct sr_nat *nat,
+  uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type);
+struct sr_nat_mapping *sr_nat_acquire_internal(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type);
+
+/* Like sr_nat_acquire_internal, but creates the mapping if there is none.
+   Its external address comes from the pool, ip_ext is used when no pool
+   is configured. Returns NULL if no port is free. */
+struct sr_nat_mapping *sr_nat_acquire_new(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, uint32_t ip_ext, sr_nat_mapping_type type);
+void sr_nat_release_mapping(struct sr_nat *nat, struct sr_nat_mapping *mapping);
+
+/* Hairpinning: the mapping behind the public ip_dst:aux_dst and the
+   source's own mapping, created as by sr_nat_acquire_new, both locked at
+   once so neither can expire while the packet is translated. Release
+   each with sr_nat_release_mapping. Returns -1 with nothing locked and
+   *src NULL if nobody is behind ip_dst:aux_dst (*dst NULL too) or the
+   source gets no mapping (*dst left set). */
+int sr_nat_acquire_hairpin(struct sr_nat *nat, uint32_t ip_int, uint16_t aux_int,
+  uint32_t ip_ext, uint32_t ip_dst, uint16_t aux_dst, sr_nat_mapping_type type,
+  struct sr_nat_mapping **src, struct sr_nat_mapping **dst);
+
+/* Handles. Take one while holding the mapping; sr_nat_acquire_handle
+   returns the mapping locked as above, or NULL if it expired since. */
+void sr_nat_get_handle(struct sr_nat *nat, struct sr_nat_mapping *mapping,
+  struct sr_nat_handle *handle);
+struct sr_nat_mapping *sr_nat_acquire_handle(struct sr_nat *nat,
+  struct sr_nat_handle *handle);
+
+/* Get a copy of the mapping associated with given external address and
+   port. You must free the returned structure if it is not NULL. Prefer
+   sr_nat_acquire_external on the data path. */
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type );
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type );
 
-/* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
+/* Get a copy of the mapping associated with given internal (ip, port) pair.
+   You must free the returned structure if it is not NULL. Prefer
+   sr_nat_acquire_internal on the data path. */
 struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
 
-/* Insert a new mapping into the nat's mapping table.
-   You must free the returned structure if it is not NULL. */
+/* Insert a new mapping into the nat's mapping table. The external port is
+   allocated here so the mapping can be indexed on both sides. Returns the
+   mapping owned by the table, or NULL if no external port is free. */
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
 
-struct sr_nat_connection *sr_nat_lookup_tcp_con(struct sr_nat_mapping *mapping, uint32_t ip_con);
-struct sr_nat_connection *sr_nat_insert_tcp_con(struct sr_nat_mapping *mapping, uint32_t ip_con);
-void check_tcp_conns(struct sr_nat *nat, struct sr_nat_mapping *nat_mapping);
-void destroy_tcp_conn(struct sr_nat_mapping *mapping, struct sr_nat_connection *conn);
+/* TCP connection tracking on an acquired mapping, connections are keyed
+   by the peer's address and port. */
+struct sr_nat_connection *sr_nat_lookup_tcp_con(struct sr_nat *nat,
+  struct sr_nat_mapping *mapping, uint32_t ip_con, uint16_t aux_con);
+/* Returns NULL if the connection table is full. */
+struct sr_nat_connection *sr_nat_insert_tcp_con(struct sr_nat *nat,
+  struct sr_nat_mapping *mapping, uint32_t ip_con, uint16_t aux_con);
+
+/* Park an unsolicited inbound SYN (an ethernet frame, not yet translated)
+   received on iface. Port unreachable is sent from the timeout thread
+   after SR_NAT_SYN_TIMEOUT seconds unless sr_nat_cancel_syn is called for
+   the same tuple first. Returns -1 if len does not cover the ip and tcp
+   headers or the queue is full. */
+int sr_nat_park_syn(struct sr_nat *nat, uint8_t *packet, unsigned int len, char *iface);
+/* An outbound SYN from an acquired mapping to ip_peer:aux_peer; drop any
+   SYN parked for that tuple without answering it, wherever the mapping's
+   port came from. */
+void sr_nat_cancel_syn(struct sr_nat *nat, struct sr_nat_mapping *mapping,
+  uint32_t ip_peer, uint16_t aux_peer);
+
+/* Mark a connection as just used and re-arm its timeout for its current
+   state. Call after every state change. */
+void sr_nat_update_tcp_con(struct sr_nat *nat, struct sr_nat_connection *conn);
+void destroy_tcp_conn(struct sr_nat *nat, struct sr_nat_connection *conn);
+
+/* Follow the close of an established connection through FIN_WAIT_1/2,
+   CLOSE_WAIT, CLOSING, LAST_ACK and TIME_WAIT given a segment of it (ip
+   header first, outbound if it comes from the internal host), and send
+   it to TIME_WAIT on RST in any state. */
+void sr_nat_track_close(struct sr_nat_connection *conn, sr_ip_hdr_t *ip_hdr, int outbound);
+/* A SYN for a connection in TIME_WAIT starts it over from CLOSED. */
+void sr_nat_reopen_tcp_con(struct sr_nat_connection *conn);
+/* Follow a hairpinned connection, seen once from each of its two
+   mappings: open on SYN, SYN-ACK and ACK whichever side starts it, then
+   close as above. */
+void sr_nat_track_hairpin(struct sr_nat_connection *conn, sr_ip_hdr_t *ip_hdr, int outbound);
+
+/* Write every mapping with its connections to nat->snapshot, through a
+   temporary file renamed into place. Each shard is saved under its lock,
+   one after the other, and one save runs at a time. Returns 0 on
+   success. */
+int sr_nat_save(struct sr_nat *nat);
+/* Load nat->snapshot into the empty table, called by sr_nat_init before
+   the timeout thread starts. Port allocators are rebuilt from the restored
+   mappings; entries that do not fit the current configuration are
+   skipped. Returns the number of mappings restored, or -1. */
+int sr_nat_restore(struct sr_nat *nat);
+
+/* Records of a mapping and a connection, for snapshots and replication. */
+void sr_nat_export_mapping(struct sr_nat_mapping *mapping, struct sr_nat_snap_mapping *m);
+void sr_nat_export_conn(struct sr_nat_connection *conn, struct sr_nat_snap_conn *c);
+/* Call fn on every mapping, one shard at a time under its lock. */
+void sr_nat_walk(struct sr_nat *nat, void (*fn)(void *ctx, struct sr_nat_mapping *mapping),
+  void *ctx);
+/* Call fn on the mapping of (ip_int, aux_int) under its shard lock, or
+   with NULL if there is none. Unlike a lookup it does not count as use. */
+void sr_nat_peek(struct sr_nat *nat, uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type,
+  void (*fn)(void *ctx, struct sr_nat_mapping *mapping), void *ctx);
+/* Put a mapping and its m->nconns connections c in the table, replacing
+   the one with the same internal side. Returns -1 if it does not fit the
+   configuration or its port is taken. */
+int sr_nat_load_mapping(struct sr_nat *nat, const struct sr_nat_snap_mapping *m,
+  const struct sr_nat_snap_conn *c);
+/* Drop the mapping of (ip_int, aux_int) if there is one. */
+void sr_nat_unload_mapping(struct sr_nat *nat, uint32_t ip_int, uint16_t aux_int,
+  sr_nat_mapping_type type);
+/* Drop every mapping. */
+void sr_nat_clear(struct sr_nat *nat);
 void destroy_nat_mapping(struct sr_nat *nat, struct sr_nat_mapping *nat_mapping);
 
 
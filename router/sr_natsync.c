@@ -0,0 +1,469 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "sr_natsync.h"
+
+#define SLOTS (2 * SR_NATSYNC_PENDING)
+
+static int64_t sr_natsync_usec(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint32_t sr_natsync_hash(uint32_t ip_int, uint16_t aux_int, uint16_t type) {
+    uint32_t h = ip_int * 2654435761u;
+    h ^= ((uint32_t) aux_int << 16 | type) * 2246822519u;
+    return (h ^ (h >> 15)) & (SLOTS - 1);
+}
+
+/* Empties a set, touching only the slots its keys use. */
+static void sr_natsync_set_clear(struct sr_natsync_set *set) {
+    uint32_t i;
+
+    for (i = 0; i < set->nkeys; i++) {
+        set->slots[set->keys[i].slot] = 0;
+    }
+    set->nkeys = 0;
+}
+
+void sr_natsync_mark(struct sr_natsync *sync, uint32_t ip_int, uint16_t aux_int,
+                     uint16_t type) {
+    struct sr_natsync_set *set;
+    struct sr_natsync_key *key;
+    uint32_t h, i;
+
+    if (sync->standby) {
+        return;
+    }
+
+    pthread_mutex_lock(&(sync->lock));
+    if (!sync->connected || sync->resync) {
+        /* Nobody to tell, or the whole table goes out anyway */
+        pthread_mutex_unlock(&(sync->lock));
+        return;
+    }
+
+    set = &(sync->sets[sync->marking]);
+    h = sr_natsync_hash(ip_int, aux_int, type);
+    while ((i = set->slots[h]) != 0) {
+        key = &(set->keys[i - 1]);
+        if (key->ip_int == ip_int && key->aux_int == aux_int && key->type == type) {
+            pthread_mutex_unlock(&(sync->lock));
+            return;
+        }
+        h = (h + 1) & (SLOTS - 1);
+    }
+
+    if (set->nkeys == SR_NATSYNC_PENDING) {
+        /* The standby is falling behind, send everything once it catches up */
+        sync->resync = 1;
+        pthread_cond_signal(&(sync->cond));
+        pthread_mutex_unlock(&(sync->lock));
+        return;
+    }
+
+    key = &(set->keys[set->nkeys++]);
+    key->ip_int = ip_int;
+    key->aux_int = aux_int;
+    key->type = type;
+    key->slot = h;
+    set->slots[h] = set->nkeys;
+    if (set->nkeys == 1) {
+        set->oldest = sr_natsync_usec();
+    } else if (set->nkeys == SR_NATSYNC_BATCH) {
+        pthread_cond_signal(&(sync->cond));
+    }
+    pthread_mutex_unlock(&(sync->lock));
+}
+
+/* Makes room for n more bytes in the frame buffer. */
+static int sr_natsync_reserve(struct sr_natsync *sync, uint32_t n) {
+    char *buf;
+    uint32_t size = sync->size;
+
+    if (sync->length + n <= size) {
+        return 0;
+    }
+    while (size < sync->length + n) {
+        size *= 2;
+    }
+    buf = realloc(sync->buf, size);
+    if (buf == NULL) {
+        return -1;
+    }
+    sync->buf = buf;
+    sync->size = size;
+    return 0;
+}
+
+static int sr_natsync_write(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int sr_natsync_read(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Sends the events built so far as one frame. */
+static int sr_natsync_flush(struct sr_natsync *sync) {
+    struct sr_natsync_frame frame;
+    int rc = 0;
+
+    if (sync->nevents > 0) {
+        memset(&frame, 0, sizeof(frame));
+        frame.magic = SR_NATSYNC_MAGIC;
+        frame.nevents = sync->nevents;
+        frame.length = sync->length;
+        frame.oldest = sync->oldest;
+        if (sr_natsync_write(sync->fd, (char *) &frame, sizeof(frame)) != 0 ||
+            sr_natsync_write(sync->fd, sync->buf, sync->length) != 0) {
+            rc = -1;
+        }
+    }
+    sync->length = 0;
+    sync->nevents = 0;
+    return rc;
+}
+
+static struct sr_natsync_event *sr_natsync_event(struct sr_natsync *sync, uint8_t op,
+                                                 uint32_t extra) {
+    struct sr_natsync_event *ev;
+
+    if (sr_natsync_reserve(sync, sizeof(*ev) + extra) != 0) {
+        return NULL;
+    }
+    ev = (struct sr_natsync_event *) (sync->buf + sync->length);
+    memset(ev, 0, sizeof(*ev));
+    ev->op = op;
+    sync->length += sizeof(*ev) + extra;
+    sync->nevents++;
+    return ev;
+}
+
+/* Key being sent, for sr_natsync_export */
+struct sr_natsync_ctx {
+    struct sr_natsync *sync;
+    struct sr_natsync_key *key;
+};
+
+/* Adds the current state of a marked mapping to the frame, called under
+   its shard lock. */
+static void sr_natsync_export(void *ctx_ptr, struct sr_nat_mapping *mapping) {
+    struct sr_natsync_ctx *ctx = (struct sr_natsync_ctx *) ctx_ptr;
+    struct sr_natsync_event *ev;
+    struct sr_nat_snap_conn *c;
+    struct sr_nat_connection *conn;
+
+    if (mapping == NULL) {
+        ev = sr_natsync_event(ctx->sync, SR_NATSYNC_DELETE, 0);
+        if (ev != NULL) {
+            ev->m.ip_int = ctx->key->ip_int;
+            ev->m.aux_int = ctx->key->aux_int;
+            ev->m.type = ctx->key->type;
+        }
+        return;
+    }
+
+    ev = sr_natsync_event(ctx->sync, SR_NATSYNC_UPSERT,
+                          mapping->nconns * sizeof(struct sr_nat_snap_conn));
+    if (ev == NULL) {
+        return;
+    }
+    sr_nat_export_mapping(mapping, &(ev->m));
+    c = (struct sr_nat_snap_conn *) (ev + 1);
+    for (conn = mapping->conns; conn != NULL; conn = conn->next) {
+        sr_nat_export_conn(conn, c++);
+    }
+}
+
+/* Collects the key of every mapping for a resync. */
+static void sr_natsync_collect(void *ctx_ptr, struct sr_nat_mapping *mapping) {
+    struct sr_natsync *sync = (struct sr_natsync *) ctx_ptr;
+    struct sr_natsync_key *key;
+
+    if (sync->nall == sync->all_size) {
+        uint32_t size = sync->all_size ? 2 * sync->all_size : SR_NATSYNC_PENDING;
+        key = realloc(sync->all, size * sizeof(*key));
+        if (key == NULL) {
+            return;
+        }
+        sync->all = key;
+        sync->all_size = size;
+    }
+    key = &(sync->all[sync->nall++]);
+    key->ip_int = mapping->ip_int;
+    key->aux_int = mapping->aux_int;
+    key->type = mapping->type;
+}
+
+/* Sends the state of n keys, a frame at a time. Each mapping is read under
+   its own shard lock, and no lock is held while sending. */
+static int sr_natsync_send_keys(struct sr_natsync *sync, struct sr_natsync_key *keys,
+                                uint32_t n) {
+    struct sr_natsync_ctx ctx;
+    uint32_t i;
+
+    ctx.sync = sync;
+    for (i = 0; i < n; i++) {
+        ctx.key = &(keys[i]);
+        sr_nat_peek(sync->nat, keys[i].ip_int, keys[i].aux_int,
+                    (sr_nat_mapping_type) keys[i].type, sr_natsync_export, &ctx);
+        if (sync->length >= SR_NATSYNC_FRAME && sr_natsync_flush(sync) != 0) {
+            return -1;
+        }
+    }
+    return sr_natsync_flush(sync);
+}
+
+static int sr_natsync_connect(struct sr_natsync *sync) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sync->path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Active side: connect to the standby, then send batches of changes. */
+static void *sr_natsync_active(void *ptr) {
+    struct sr_natsync *sync = (struct sr_natsync *) ptr;
+    struct sr_natsync_set *set;
+    struct timespec until;
+    int64_t now;
+    int resync, rc;
+
+    while (1) {
+        if (sync->fd < 0) {
+            sync->fd = sr_natsync_connect(sync);
+            if (sync->fd < 0) {
+                sleep(1);
+                continue;
+            }
+            printf("[NATSYNC] Connected to standby %s\n", sync->path);
+            pthread_mutex_lock(&(sync->lock));
+            sync->connected = 1;
+            sync->resync = 1;
+            pthread_mutex_unlock(&(sync->lock));
+        }
+
+        pthread_mutex_lock(&(sync->lock));
+        now = sr_natsync_usec() + SR_NATSYNC_INTERVAL * 1000;
+        until.tv_sec = now / 1000000;
+        until.tv_nsec = (now % 1000000) * 1000;
+        while (!sync->resync && sync->sets[sync->marking].nkeys < SR_NATSYNC_BATCH) {
+            if (pthread_cond_timedwait(&(sync->cond), &(sync->lock), &until) == ETIMEDOUT) {
+                break;
+            }
+        }
+        set = &(sync->sets[sync->marking]);
+        sync->marking ^= 1;
+        resync = sync->resync;
+        sync->resync = 0;
+        if (resync) {
+            /* Marks made so far are covered by the walk */
+            sr_natsync_set_clear(set);
+            sr_natsync_set_clear(&(sync->sets[sync->marking]));
+        }
+        pthread_mutex_unlock(&(sync->lock));
+
+        if (resync) {
+            sync->oldest = sr_natsync_usec();
+            sync->nall = 0;
+            sr_nat_walk(sync->nat, sr_natsync_collect, sync);
+            printf("[NATSYNC] Sending %u mappings to standby\n", sync->nall);
+            sr_natsync_event(sync, SR_NATSYNC_RESET, 0);
+            rc = sr_natsync_send_keys(sync, sync->all, sync->nall);
+        } else {
+            sync->oldest = set->oldest;
+            rc = sr_natsync_send_keys(sync, set->keys, set->nkeys);
+            sr_natsync_set_clear(set);
+        }
+
+        if (rc != 0) {
+            fprintf(stderr, "[NATSYNC] Lost standby %s\n", sync->path);
+            pthread_mutex_lock(&(sync->lock));
+            sync->connected = 0;
+            pthread_mutex_unlock(&(sync->lock));
+            close(sync->fd);
+            sync->fd = -1;
+            sync->length = 0;
+            sync->nevents = 0;
+        }
+    }
+    return NULL;
+}
+
+/* Standby side: apply the events of one frame. */
+static void sr_natsync_apply(struct sr_natsync *sync, const struct sr_natsync_frame *frame) {
+    const char *p = sync->buf, *end = sync->buf + frame->length;
+    const struct sr_natsync_event *ev;
+    int64_t lag;
+    uint32_t i;
+
+    for (i = 0; i < frame->nevents && p + sizeof(*ev) <= end; i++) {
+        ev = (const struct sr_natsync_event *) p;
+        p += sizeof(*ev);
+        switch (ev->op) {
+            case SR_NATSYNC_UPSERT:
+                if ((size_t) (end - p) < ev->m.nconns * sizeof(struct sr_nat_snap_conn)) {
+                    p = end;
+                    break;
+                }
+                if (sr_nat_load_mapping(sync->nat, &(ev->m),
+                                        (const struct sr_nat_snap_conn *) p) != 0) {
+                    sync->failed++;
+                }
+                p += ev->m.nconns * sizeof(struct sr_nat_snap_conn);
+                break;
+            case SR_NATSYNC_DELETE:
+                sr_nat_unload_mapping(sync->nat, ev->m.ip_int, ev->m.aux_int,
+                                      (sr_nat_mapping_type) ev->m.type);
+                break;
+            case SR_NATSYNC_RESET:
+                sr_nat_clear(sync->nat);
+                break;
+        }
+        sync->events++;
+    }
+
+    lag = sr_natsync_usec() - frame->oldest;
+    sync->frames++;
+    sync->lag_sum += lag;
+    if (lag > sync->lag_max) {
+        sync->lag_max = lag;
+    }
+    if (difftime(time(NULL), sync->last_report) >= SR_NAT_REPORT_INTERVAL) {
+        printf("[NATSYNC] %u frames, %u events, %u not applied, lag avg %.1f ms max %.1f ms\n",
+               sync->frames, sync->events, sync->failed,
+               sync->lag_sum / 1000.0 / sync->frames, sync->lag_max / 1000.0);
+        sync->frames = sync->events = sync->failed = 0;
+        sync->lag_sum = sync->lag_max = 0;
+        sync->last_report = time(NULL);
+    }
+}
+
+/* Standby side: take one active router at a time, apply its frames, and
+   take over when it goes away. */
+static void *sr_natsync_standby(void *ptr) {
+    struct sr_natsync *sync = (struct sr_natsync *) ptr;
+    struct sockaddr_un addr;
+    struct sr_natsync_frame frame;
+    int lfd;
+
+    lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sync->path, sizeof(addr.sun_path) - 1);
+    unlink(sync->path);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(lfd, 1) != 0) {
+        fprintf(stderr, "[NATSYNC] Cannot listen on %s: %s\n", sync->path, strerror(errno));
+        sync->nat->standby = 0;
+        return NULL;
+    }
+    printf("[NATSYNC] Standby listening on %s\n", sync->path);
+
+    while (1) {
+        sync->fd = accept(lfd, NULL, NULL);
+        if (sync->fd < 0) {
+            continue;
+        }
+        printf("[NATSYNC] Active router connected\n");
+        sync->nat->standby = 1;
+        sync->last_report = time(NULL);
+
+        while (sr_natsync_read(sync->fd, (char *) &frame, sizeof(frame)) == 0) {
+            if (frame.magic != SR_NATSYNC_MAGIC || frame.length > SR_NATSYNC_MAX_FRAME) {
+                fprintf(stderr, "[NATSYNC] Bad frame from active router\n");
+                break;
+            }
+            sync->length = 0;
+            if (sr_natsync_reserve(sync, frame.length) != 0 ||
+                sr_natsync_read(sync->fd, sync->buf, frame.length) != 0) {
+                break;
+            }
+            sr_natsync_apply(sync, &frame);
+        }
+
+        close(sync->fd);
+        sync->fd = -1;
+        sync->nat->standby = 0;
+        printf("[NATSYNC] Active router gone, taking over\n");
+    }
+    return NULL;
+}
+
+int sr_natsync_init(struct sr_natsync *sync, struct sr_nat *nat, const char *path,
+                    int standby) {
+    pthread_attr_t attr;
+    int i;
+
+    memset(sync, 0, sizeof(struct sr_natsync));
+    sync->nat = nat;
+    sync->path = path;
+    sync->standby = standby;
+    sync->fd = -1;
+
+    sync->size = SR_NATSYNC_FRAME;
+    sync->buf = malloc(sync->size);
+    if (sync->buf == NULL) {
+        return -1;
+    }
+    for (i = 0; i < 2; i++) {
+        sync->sets[i].keys = malloc(SR_NATSYNC_PENDING * sizeof(struct sr_natsync_key));
+        sync->sets[i].slots = calloc(SLOTS, sizeof(uint32_t));
+        if (sync->sets[i].keys == NULL || sync->sets[i].slots == NULL) {
+            return -1;
+        }
+    }
+    pthread_mutex_init(&(sync->lock), NULL);
+    pthread_cond_init(&(sync->cond), NULL);
+
+    /* Nothing expires on a standby until it takes over */
+    nat->standby = standby;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&(sync->thread), &attr,
+                       standby ? sr_natsync_standby : sr_natsync_active, sync) != 0) {
+        return -1;
+    }
+    return 0;
+}
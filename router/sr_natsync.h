@@ -0,0 +1,123 @@
+/* This file defines NAT state replication from an active router to a warm
+   standby over a Unix-domain socket.
+
+   The active side only records which mappings changed: the NAT marks the
+   internal key of a mapping when it is created, destroyed, changes the
+   state of one of its TCP connections, or has been used again after
+   SR_NATSYNC_REFRESH seconds. Every SR_NATSYNC_INTERVAL milliseconds, or
+   as soon as SR_NATSYNC_BATCH keys are marked, the sync thread takes the
+   marked set, reads the current state of each mapping and sends it in one
+   frame, so however often a mapping changes it costs one event per batch.
+   A key whose mapping is gone is sent as a delete.
+
+   On (re)connect, or when more than SR_NATSYNC_PENDING keys pile up while
+   the standby is slow, the active side starts over: a reset followed by
+   every mapping in the table.
+
+   The standby applies events to its own table, where nothing expires
+   while the active side is connected (timers are pushed back by
+   SR_NATSYNC_REFRESH seconds instead). When the connection drops it takes
+   over with the replicated table and normal timeouts. Replication lag,
+   from the oldest change of a frame to the frame being applied, is
+   reported every SR_NAT_REPORT_INTERVAL seconds.
+ */
+
+#ifndef SR_NATSYNC_H
+#define SR_NATSYNC_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include "sr_nat.h"
+
+#define SR_NATSYNC_REFRESH   10     /* Seconds between refreshes of a used mapping */
+#define SR_NATSYNC_INTERVAL  50     /* Milliseconds between two batches */
+#define SR_NATSYNC_BATCH     1024   /* Marked keys that send a batch at once */
+#define SR_NATSYNC_PENDING   65536  /* Marked keys before falling back to a resync */
+#define SR_NATSYNC_FRAME     65536  /* Bytes of events per frame */
+#define SR_NATSYNC_MAX_FRAME (16 * 1024 * 1024) /* Largest frame a standby accepts */
+
+#define SR_NATSYNC_MAGIC     0x4e415453 /* "NATS" */
+
+#define SR_NATSYNC_UPSERT    1
+#define SR_NATSYNC_DELETE    2
+#define SR_NATSYNC_RESET     3
+
+/* Frame on the wire: this header, then length bytes of events. Like the
+   snapshot records, fields are in host byte order. */
+struct sr_natsync_frame {
+    uint32_t magic;
+    uint32_t nevents;
+    uint32_t length;
+    uint32_t pad;
+    int64_t oldest;             /* Time of the oldest change, in usec */
+};
+
+/* Event: this header, then for an upsert m.nconns connection records.
+   A delete only uses the internal key of m, a reset nothing. */
+struct sr_natsync_event {
+    uint8_t op;
+    uint8_t pad[7];
+    struct sr_nat_snap_mapping m;
+};
+
+struct sr_natsync_key {
+    uint32_t ip_int;
+    uint16_t aux_int;
+    uint16_t type;
+    uint32_t slot;              /* Where the set indexes it */
+};
+
+/* Set of marked keys: a dense array plus an open addressing index into
+   it (0 for a free slot, else array index + 1). */
+struct sr_natsync_set {
+    struct sr_natsync_key *keys;
+    uint32_t nkeys;
+    uint32_t *slots;
+    int64_t oldest;             /* usec of the first mark */
+};
+
+struct sr_natsync {
+    struct sr_nat *nat;
+    const char *path;
+    int standby;                /* Role, set by sr_natsync_init */
+    int fd;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct sr_natsync_set sets[2]; /* Marked, and being sent */
+    int marking;                /* Index of the set taking marks */
+    int connected;              /* Marks are only taken while connected */
+    int resync;                 /* Send the whole table next */
+    struct sr_natsync_key *all; /* Every key of the table, for a resync */
+    uint32_t nall;
+    uint32_t all_size;
+
+    char *buf;                  /* Frame being built or read */
+    uint32_t size;
+    uint32_t length;
+    uint32_t nevents;
+    int64_t oldest;
+
+    /* Standby statistics since the last report */
+    uint32_t frames;
+    uint32_t events;
+    uint32_t failed;
+    int64_t lag_sum;
+    int64_t lag_max;
+    time_t last_report;
+
+    pthread_t thread;
+};
+
+/* Starts replicating nat to the standby listening at path, or, if standby
+   is set, listens at path and applies what the active side sends to nat.
+   Returns 0 on success. */
+int sr_natsync_init(struct sr_natsync *sync, struct sr_nat *nat, const char *path,
+                    int standby);
+
+/* Marks a mapping as changed. Called with the mapping's shard locked. */
+void sr_natsync_mark(struct sr_natsync *sync, uint32_t ip_int, uint16_t aux_int,
+                     uint16_t type);
+
+#endif
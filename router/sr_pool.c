@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sr_pool.h"
+
+/* Room in front of each object for the free list link, enough to keep the
+   object itself aligned for any member type. */
+#define HDR_SIZE 16
+
+struct sr_pool_obj {
+    struct sr_pool_obj *next;
+};
+
+struct sr_pool_cache {
+    struct sr_pool *pool;
+    struct sr_pool_cache *next;
+    pthread_mutex_t lock;       /* Owner's, only contended by a steal */
+    uint32_t count;
+    void *objs[SR_POOL_CACHE_SIZE];
+};
+
+#define OBJ_OF(hdr) ((void *) ((char *) (hdr) + HDR_SIZE))
+#define HDR_OF(obj) ((struct sr_pool_obj *) ((char *) (obj) - HDR_SIZE))
+
+/* Moves up to n objects from this cache to the shared list. Caller holds
+   the cache lock. */
+static void sr_pool_flush(struct sr_pool_cache *cache, uint32_t n) {
+    struct sr_pool *pool = cache->pool;
+
+    pthread_mutex_lock(&(pool->lock));
+    while (n-- > 0 && cache->count > 0) {
+        struct sr_pool_obj *hdr = HDR_OF(cache->objs[--cache->count]);
+        hdr->next = pool->free;
+        pool->free = hdr;
+        pool->nfree++;
+    }
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+/* Thread exit: give the cached objects back, keep the cache on the pool's
+   list so sr_pool_destroy frees it. */
+static void sr_pool_cache_exit(void *ptr) {
+    struct sr_pool_cache *cache = (struct sr_pool_cache *) ptr;
+
+    pthread_mutex_lock(&(cache->lock));
+    sr_pool_flush(cache, cache->count);
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+/* The shared list is empty: take an object from another thread's cache.
+   Only one cache lock is held at a time, and never with the pool lock,
+   so this cannot deadlock with a flush or another steal. */
+static void *sr_pool_steal(struct sr_pool *pool, struct sr_pool_cache *own) {
+    struct sr_pool_cache *cache;
+    void *obj = NULL;
+
+    /* Caches are only ever added at the head, the rest of the list is
+       stable */
+    pthread_mutex_lock(&(pool->lock));
+    cache = pool->caches;
+    pthread_mutex_unlock(&(pool->lock));
+
+    for (; cache != NULL && obj == NULL; cache = cache->next) {
+        if (cache == own) {
+            continue;
+        }
+        pthread_mutex_lock(&(cache->lock));
+        if (cache->count > 0) {
+            obj = cache->objs[--cache->count];
+        }
+        pthread_mutex_unlock(&(cache->lock));
+    }
+    return obj;
+}
+
+/* This thread's cache, created on first use. */
+static struct sr_pool_cache *sr_pool_cache_get(struct sr_pool *pool) {
+    struct sr_pool_cache *cache = pthread_getspecific(pool->key);
+
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(struct sr_pool_cache));
+        if (cache == NULL) {
+            return NULL;
+        }
+        cache->pool = pool;
+        if (pthread_mutex_init(&(cache->lock), NULL) != 0) {
+            free(cache);
+            return NULL;
+        }
+
+        pthread_mutex_lock(&(pool->lock));
+        cache->next = pool->caches;
+        pool->caches = cache;
+        pthread_mutex_unlock(&(pool->lock));
+
+        pthread_setspecific(pool->key, cache);
+    }
+    return cache;
+}
+
+int sr_pool_init(struct sr_pool *pool, const char *name, size_t size,
+                 uint32_t capacity) {
+    uint32_t i;
+
+    memset(pool, 0, sizeof(struct sr_pool));
+    pool->name = name;
+    pool->stride = (HDR_SIZE + size + HDR_SIZE - 1) & ~(size_t) (HDR_SIZE - 1);
+    pool->capacity = capacity;
+
+    pool->slab = calloc(capacity, pool->stride);
+    if (capacity > 0 && pool->slab == NULL) {
+        return -1;
+    }
+
+    /* Chain the slab back to front so objects are handed out in address
+       order */
+    for (i = capacity; i > 0; i--) {
+        struct sr_pool_obj *hdr = (struct sr_pool_obj *) (pool->slab + (size_t) (i - 1) * pool->stride);
+        hdr->next = pool->free;
+        pool->free = hdr;
+    }
+    pool->nfree = capacity;
+
+    if (pthread_mutex_init(&(pool->lock), NULL) != 0) {
+        free(pool->slab);
+        return -1;
+    }
+    if (pthread_key_create(&(pool->key), sr_pool_cache_exit) != 0) {
+        pthread_mutex_destroy(&(pool->lock));
+        free(pool->slab);
+        return -1;
+    }
+    return 0;
+}
+
+void sr_pool_destroy(struct sr_pool *pool) {
+    pthread_key_delete(pool->key);
+    while (pool->caches != NULL) {
+        struct sr_pool_cache *next = pool->caches->next;
+        pthread_mutex_destroy(&(pool->caches->lock));
+        free(pool->caches);
+        pool->caches = next;
+    }
+    pthread_mutex_destroy(&(pool->lock));
+    free(pool->slab);
+    pool->slab = NULL;
+    pool->free = NULL;
+    pool->capacity = pool->nfree = 0;
+}
+
+void *sr_pool_alloc(struct sr_pool *pool) {
+    struct sr_pool_cache *cache = sr_pool_cache_get(pool);
+    struct sr_pool_obj *hdr;
+    void *obj;
+
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&(cache->lock));
+    if (cache->count == 0) {
+        /* Refill a batch from the shared list */
+        pthread_mutex_lock(&(pool->lock));
+        while (cache->count < SR_POOL_BATCH && pool->free != NULL) {
+            hdr = pool->free;
+            pool->free = hdr->next;
+            pool->nfree--;
+            cache->objs[cache->count++] = OBJ_OF(hdr);
+        }
+        pthread_mutex_unlock(&(pool->lock));
+
+        if (cache->count == 0) {
+            pthread_mutex_unlock(&(cache->lock));
+            return sr_pool_steal(pool, cache);
+        }
+    }
+
+    obj = cache->objs[--cache->count];
+    pthread_mutex_unlock(&(cache->lock));
+    return obj;
+}
+
+void sr_pool_free(struct sr_pool *pool, void *obj) {
+    struct sr_pool_cache *cache = sr_pool_cache_get(pool);
+
+    if (cache == NULL) {
+        /* No cache for this thread, go straight to the shared list */
+        struct sr_pool_obj *hdr = HDR_OF(obj);
+        pthread_mutex_lock(&(pool->lock));
+        hdr->next = pool->free;
+        pool->free = hdr;
+        pool->nfree++;
+        pthread_mutex_unlock(&(pool->lock));
+        return;
+    }
+
+    pthread_mutex_lock(&(cache->lock));
+    if (cache->count == SR_POOL_CACHE_SIZE) {
+        sr_pool_flush(cache, SR_POOL_BATCH);
+    }
+    cache->objs[cache->count++] = obj;
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+uint32_t sr_pool_in_use(struct sr_pool *pool) {
+    struct sr_pool_cache *cache;
+    uint32_t idle;
+
+    pthread_mutex_lock(&(pool->lock));
+    idle = pool->nfree;
+    cache = pool->caches;
+    pthread_mutex_unlock(&(pool->lock));
+
+    /* Each count under its cache lock, taken without the pool lock as in
+       sr_pool_steal */
+    for (; cache != NULL; cache = cache->next) {
+        pthread_mutex_lock(&(cache->lock));
+        idle += cache->count;
+        pthread_mutex_unlock(&(cache->lock));
+    }
+
+    return idle > pool->capacity ? 0 : pool->capacity - idle;
+}
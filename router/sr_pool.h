@@ -0,0 +1,68 @@
+/* This file defines a fixed-size object pool. All objects are carved out of
+   one slab allocated when the pool is created, so memory use is known up
+   front and allocating or freeing is a constant-time pop or push.
+
+   Each thread keeps a small cache of free objects and only takes the pool
+   lock to move a batch of them to or from the shared free list, so the
+   thread that creates objects and the one that expires them do not contend
+   on every call. A cache has its own lock, which only its thread takes
+   unless the shared list runs dry: an allocation then takes an object
+   from another thread's cache, so it fails only when every object is in
+   use.
+
+   The slab is never returned to the system while the pool exists, and a
+   free object's contents are left alone (the free list link lives in a
+   header in front of it). A stale pointer to a pooled object therefore
+   always points at an object of the same type.
+ */
+
+#ifndef SR_POOL_H
+#define SR_POOL_H
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#define SR_POOL_CACHE_SIZE  32  /* Objects a thread may keep to itself */
+#define SR_POOL_BATCH       16  /* Objects moved per refill or flush */
+
+struct sr_pool_obj;
+struct sr_pool_cache;
+
+struct sr_pool {
+    const char *name;           /* Used when reporting */
+    size_t stride;              /* Header plus object, rounded up */
+    uint32_t capacity;          /* Total number of objects */
+    uint32_t nfree;             /* Objects on the shared free list */
+
+    char *slab;
+    struct sr_pool_obj *free;   /* Shared free list */
+    struct sr_pool_cache *caches; /* Every thread's cache, for reporting */
+
+    pthread_mutex_t lock;
+    pthread_key_t key;          /* This thread's cache */
+};
+
+/* Creates a pool of capacity objects of size bytes each. Returns 0 on
+   success. */
+int sr_pool_init(struct sr_pool *pool, const char *name, size_t size,
+                 uint32_t capacity);
+
+/* Frees the slab and every thread's cache. No object of the pool may be
+   used afterwards. */
+void sr_pool_destroy(struct sr_pool *pool);
+
+/* Returns a free object, or NULL if all capacity objects are in use. The
+   object holds whatever it held when it was last freed (zeroes if it was
+   never used). */
+void *sr_pool_alloc(struct sr_pool *pool);
+
+/* Returns an object obtained from sr_pool_alloc to the pool. */
+void sr_pool_free(struct sr_pool *pool, void *obj);
+
+/* Number of objects currently handed out. The shared list and each cache
+   are counted one after the other, so the count can be off by a few while
+   other threads are busy. */
+uint32_t sr_pool_in_use(struct sr_pool *pool);
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sr_portalloc.h"
+
+#define WORD_BITS 64
+#define ALL_ONES (~(uint64_t) 0)
+
+/* Marks slot as used and keeps the summary bitmap in sync. */
+static void sr_portalloc_set(struct sr_portalloc *pa, uint32_t slot) {
+    uint32_t w = slot / WORD_BITS;
+
+    pa->words[w] |= (uint64_t) 1 << (slot % WORD_BITS);
+    if (pa->words[w] == ALL_ONES) {
+        pa->summary[w / WORD_BITS] |= (uint64_t) 1 << (w % WORD_BITS);
+    }
+}
+
+/* Returns the first word at or after from (wrapping around) that still has
+   a free slot, or -1 if every word is full. */
+static int sr_portalloc_next_word(struct sr_portalloc *pa, uint32_t from) {
+    uint32_t s, i;
+    uint64_t free_words;
+
+    if (from >= pa->nwords) {
+        from = 0;
+    }
+
+    s = from / WORD_BITS;
+    free_words = ~pa->summary[s] & (ALL_ONES << (from % WORD_BITS));
+    for (i = 0; i <= pa->nsummary; i++) {
+        if (free_words) {
+            return s * WORD_BITS + __builtin_ctzll(free_words);
+        }
+        s = (s + 1 == pa->nsummary) ? 0 : s + 1;
+        free_words = ~pa->summary[s];
+    }
+
+    return -1;
+}
+
+int sr_portalloc_init(struct sr_portalloc *pa, uint16_t first, uint16_t last,
+                      uint16_t stride, int randomize) {
+    uint32_t slot;
+
+    memset(pa, 0, sizeof(struct sr_portalloc));
+    if (last < first || stride == 0) {
+        return -1;
+    }
+
+    pa->first = first;
+    pa->stride = stride;
+    pa->nslots = ((uint32_t) last - first) / stride + 1;
+    pa->nfree = pa->nslots;
+    pa->randomize = randomize;
+    pa->nwords = (pa->nslots + WORD_BITS - 1) / WORD_BITS;
+    pa->nsummary = (pa->nwords + WORD_BITS - 1) / WORD_BITS;
+
+    pa->words = calloc(pa->nwords, sizeof(uint64_t));
+    pa->summary = calloc(pa->nsummary, sizeof(uint64_t));
+    if (pa->words == NULL || pa->summary == NULL) {
+        sr_portalloc_destroy(pa);
+        return -1;
+    }
+
+    /* Slots past the end of the range and words past the end of the bitmap
+       are permanently in use so the search never returns them. */
+    for (slot = pa->nslots; slot < pa->nwords * WORD_BITS; slot++) {
+        sr_portalloc_set(pa, slot);
+    }
+    for (slot = pa->nwords; slot < pa->nsummary * WORD_BITS; slot++) {
+        pa->summary[slot / WORD_BITS] |= (uint64_t) 1 << (slot % WORD_BITS);
+    }
+
+    return 0;
+}
+
+void sr_portalloc_destroy(struct sr_portalloc *pa) {
+    free(pa->words);
+    free(pa->summary);
+    pa->words = NULL;
+    pa->summary = NULL;
+    pa->nslots = pa->nfree = 0;
+}
+
+int sr_portalloc_alloc(struct sr_portalloc *pa) {
+    uint32_t start, w;
+    uint64_t free_bits;
+    int word;
+
+    if (pa->nfree == 0) {
+        return -1;
+    }
+
+    start = pa->randomize ? (uint32_t) rand() % pa->nslots : pa->next;
+    w = start / WORD_BITS;
+
+    /* Free slots in the starting word at or after start */
+    free_bits = ~pa->words[w] & (ALL_ONES << (start % WORD_BITS));
+    if (free_bits == 0) {
+        word = sr_portalloc_next_word(pa, w + 1);
+        if (word < 0) {
+            return -1;
+        }
+        w = (uint32_t) word;
+        free_bits = ~pa->words[w];
+    }
+
+    start = w * WORD_BITS + __builtin_ctzll(free_bits);
+    sr_portalloc_set(pa, start);
+    pa->nfree--;
+    pa->next = (start + 1 == pa->nslots) ? 0 : start + 1;
+
+    return (int) (pa->first + start * pa->stride);
+}
+
+void sr_portalloc_release(struct sr_portalloc *pa, uint16_t port) {
+    uint32_t slot, w;
+    uint64_t bit;
+
+    if (port < pa->first || (port - pa->first) % pa->stride != 0) {
+        return;
+    }
+
+    slot = (port - pa->first) / pa->stride;
+    if (slot >= pa->nslots) {
+        return;
+    }
+    w = slot / WORD_BITS;
+    bit = (uint64_t) 1 << (slot % WORD_BITS);
+    if (!(pa->words[w] & bit)) {
+        return;
+    }
+
+    pa->words[w] &= ~bit;
+    pa->summary[w / WORD_BITS] &= ~((uint64_t) 1 << (w % WORD_BITS));
+    pa->nfree++;
+}
+
+int sr_portalloc_reserve(struct sr_portalloc *pa, uint16_t port) {
+    uint32_t slot;
+
+    if (port < pa->first || (port - pa->first) % pa->stride != 0) {
+        return -1;
+    }
+
+    slot = (port - pa->first) / pa->stride;
+    if (slot >= pa->nslots ||
+        (pa->words[slot / WORD_BITS] & ((uint64_t) 1 << (slot % WORD_BITS)))) {
+        return -1;
+    }
+
+    sr_portalloc_set(pa, slot);
+    pa->nfree--;
+    return 0;
+}
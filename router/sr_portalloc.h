@@ -0,0 +1,54 @@
+/* This file defines the external port allocator used by the NAT. Each pool
+   hands out every stride-th port of a range and keeps one bit per port, so
+   a full 64K range costs 8 KB. Pools with the same stride and different
+   first ports split a range between them without overlapping.
+
+   Allocation is next-fit: the search starts right after the last port
+   handed out (or at a random slot if the pool was created with randomize
+   set), which also keeps a just-released port from being reused at once.
+   A second-level summary bitmap marks which 64-bit words are full, so
+   finding a free port only looks at a handful of words no matter how many
+   ports are in use.
+
+   A pool is not thread safe; callers serialize access with their own lock.
+ */
+
+#ifndef SR_PORTALLOC_H
+#define SR_PORTALLOC_H
+
+#include <inttypes.h>
+
+struct sr_portalloc {
+    uint32_t first;             /* First port in the range */
+    uint32_t stride;            /* Distance between two ports of the pool */
+    uint32_t nslots;            /* Number of ports in the range */
+    uint32_t nfree;             /* Ports currently free */
+    uint32_t next;              /* Slot where the next search starts */
+    int randomize;              /* Start each search at a random slot */
+
+    uint64_t *words;            /* One bit per slot, set when in use */
+    uint32_t nwords;
+    uint64_t *summary;          /* One bit per word, set when word is full */
+    uint32_t nsummary;
+};
+
+/* Creates a pool for ports first, first + stride, ... up to last inclusive.
+   Returns 0 on success. */
+int sr_portalloc_init(struct sr_portalloc *pa, uint16_t first, uint16_t last,
+                      uint16_t stride, int randomize);
+
+/* Frees the bitmaps of the pool. */
+void sr_portalloc_destroy(struct sr_portalloc *pa);
+
+/* Returns a free port in host byte order and marks it used, or -1 if the
+   pool is exhausted. */
+int sr_portalloc_alloc(struct sr_portalloc *pa);
+
+/* Returns a port to the pool. Ports that are not in the pool are ignored. */
+void sr_portalloc_release(struct sr_portalloc *pa, uint16_t port);
+
+/* Marks a given port used, as when state is restored. Returns -1 if the
+   port is not in the pool or already in use. */
+int sr_portalloc_reserve(struct sr_portalloc *pa, uint16_t port);
+
+#endif
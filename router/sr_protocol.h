@@ -120,6 +120,16 @@ struct sr_tcp_hdr {
 } __attribute__ ((packed)) ;
 typedef struct sr_tcp_hdr sr_tcp_hdr_t;
 
+/* Structure of a UDP header
+ */
+struct sr_udp_hdr {
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint16_t length;
+  uint16_t checksum; /* 0 means the sender did not compute one */
+} __attribute__ ((packed)) ;
+typedef struct sr_udp_hdr sr_udp_hdr_t;
+
 
 /* Structure of a type3 ICMP header
  */
@@ -185,6 +195,8 @@ typedef struct sr_ethernet_hdr sr_ethernet_hdr_t;
 
 enum sr_ip_protocol {
   ip_protocol_icmp = 0x0001,
+  ip_protocol_tcp = 0x0006,
+  ip_protocol_udp = 0x0011,
 };
 
 enum sr_ethertype {
@@ -15,6 +15,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <unistd.h>
 
 #include "sr_nat.h"
@@ -23,6 +24,7 @@
 #include "sr_router.h"
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
+#include "sr_adj.h"
 #include "sr_utils.h"
 
 /*---------------------------------------------------------------------
@@ -33,7 +35,7 @@
  *
  *---------------------------------------------------------------------*/
 
-void sr_init(struct sr_instance* sr, int nat, int icmp_timeout_int, int tcp_idle_timeout, int transitory_idle_timeout)
+void sr_init(struct sr_instance* sr, int nat, int icmp_timeout_int, int tcp_idle_timeout, int transitory_idle_timeout, int udp_idle_timeout)
 {
     /* REQUIRES */
     assert(sr);
@@ -54,12 +56,14 @@ void sr_init(struct sr_instance* sr, int nat, int icmp_timeout_int, int tcp_idle
 
     /**/
     if (nat){
-        sr_nat_init(&(sr->nat));
+        /* Timeouts first, restored mappings are armed with them */
         (sr->nat).icmp_timeout_int = icmp_timeout_int;
         (sr->nat).tcp_idle_timeout = tcp_idle_timeout;
         (sr->nat).transitory_idle_timeout = transitory_idle_timeout;
+        (sr->nat).udp_idle_timeout = udp_idle_timeout;
         /* Do I need this tho...*/
         (sr->nat).sr = sr;
+        sr_nat_init(&(sr->nat));
     }
     
 } /* -- sr_init -- */
@@ -151,6 +155,8 @@ int sr_nat_handleIPpacket(struct sr_instance* sr,
 
     /* Process the IP packet.. */
     sr_ip_hdr_t *ip_packet = (sr_ip_hdr_t*) (packet + sizeof(sr_ethernet_hdr_t));
+    /* Header checksum change from the NAT rewrite, applied with the ttl */
+    uint32_t ip_sum_diff = 0;
 
     /*need delete*/
    
@@ -159,6 +165,20 @@ int sr_nat_handleIPpacket(struct sr_instance* sr,
     /* See if this packet is for me or not. */
     struct sr_if *target_if = (struct sr_if*) checkDestIsIface(ip_packet->ip_dst, sr);
     uint8_t ip_proto = ip_protocol((uint8_t *) ip_packet);
+
+    /* Addresses of the NAT pool belong to the external interface too */
+    if(target_if == NULL && !is_nat_internal_iface(interface) &&
+       sr_nat_is_external_addr(&(sr->nat), ip_packet->ip_dst)){
+        target_if = sr_get_interface(sr, interface);
+    }
+
+    /* Internal host to another internal host through a public address */
+    if(is_nat_internal_iface(interface) &&
+       (ip_proto == ip_protocol_tcp || ip_proto == ip_protocol_udp) &&
+       ((target_if != NULL && is_nat_external_iface(target_if->name)) ||
+        sr_nat_is_external_addr(&(sr->nat), ip_packet->ip_dst))){
+        return sr_nat_hairpin(sr, packet, len, interface);
+    }
     
     /* This packet is for one of the interfaces */
     if(target_if != NULL){
@@ -173,10 +193,11 @@ int sr_nat_handleIPpacket(struct sr_instance* sr,
                 
                 struct sr_arpcache *cache = &(sr->cache);
                 struct sr_rt* matching_entry = longest_prefix_match(sr, ip_packet->ip_src);
-                struct sr_arpentry* arpentry = sr_arpcache_lookup(cache, (uint32_t)((matching_entry->gw).s_addr));
+                unsigned char arp_mac[ETHER_ADDR_LEN];
+                int arp_hit = sr_arpcache_lookup_mac(cache, (uint32_t)((matching_entry->gw).s_addr), arp_mac);
                 
-                if(arpentry != NULL){/* Find ARP cache matching the echo req src*/
-                    return send_echo_reply(sr, interface, packet, len, arpentry);
+                if(arp_hit){/* Find ARP cache matching the echo req src*/
+                    return send_echo_reply(sr, interface, packet, len, arp_mac);
                 }else{/* Send ARP req to find the echo req src MAC addr*/
                     sr_arpcache_queuereq(&(sr->cache),(uint32_t)((matching_entry->gw).s_addr),packet,len,interface);
                     return 0;
@@ -205,23 +226,24 @@ int sr_nat_handleIPpacket(struct sr_instance* sr,
                 /* Locate icmp header.. */
                 sr_icmp_t3_hdr_t *icmp_hdr = (sr_icmp_t3_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
 
-                /* Look up external addr/port pair given internal info */
-                struct sr_nat_mapping *nat_entry = sr_nat_lookup_external(&(sr->nat), icmp_hdr->identifier, nat_mapping_icmp);
+                /* Errors belong to the flow of the packet they quote */
+                struct sr_nat_mapping *nat_entry = NULL;
+                if (sr_nat_is_icmp_error(icmp_hdr->icmp_type)) {
+                    if (sr_nat_icmp_error(sr, packet, len, 1, &ip_sum_diff) != 0) {
+                        printf("[NAT ICMP] error for an unknown flow, drop it\n");
+                        return -1;
+                    }
 
-                /* No mapping found.. */
-                if (nat_entry != NULL) {
+                /* Look up external addr/port pair given internal info */
+                } else if ((nat_entry = sr_nat_acquire_external(&(sr->nat), ip_packet->ip_dst, icmp_hdr->identifier, nat_mapping_icmp)) != NULL) {
                     printf("[NAT ICMP: found mapping in table, good] \n");
+                    ip_sum_diff = cksum_diff32(0, ip_packet->ip_dst, nat_entry->ip_int);
                     ip_packet->ip_dst = nat_entry->ip_int;
-                    /*int diff = (int)icmp_hdr->identifier - (int)nat_entry->aux_int;*/
+                    /* Only the id is covered by the icmp checksum, patch it in place */
+                    icmp_hdr->icmp_sum = cksum_adjust(icmp_hdr->icmp_sum,
+                                                      cksum_diff16(0, icmp_hdr->identifier, nat_entry->aux_int));
                     icmp_hdr->identifier = nat_entry->aux_int;
-                    nat_entry->last_updated = time(NULL);
-                    icmp_hdr->icmp_sum = 0;
-                    icmp_hdr->icmp_sum = cksum(icmp_hdr, len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t));
-
-                   
-                    /*int icmpOffset = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t);*/
-                    
-                    /*icmp_hdr->icmp_sum = (uint16_t) ((int) icmp_hdr->icmp_sum - diff);*/
+                    sr_nat_release_mapping(&(sr->nat), nat_entry);
 
                 }else{
                     printf("[NAT ICMP] didn't found entry..shit\n");
@@ -236,26 +258,30 @@ int sr_nat_handleIPpacket(struct sr_instance* sr,
                 
 
 
-                struct sr_nat_mapping *nat_lookup = sr_nat_lookup_external(&(sr->nat), tcp_hdr->dst_port, nat_mapping_tcp);
+                /* The mapping stays locked until it is released below */
+                struct sr_nat_mapping *nat_lookup = sr_nat_acquire_external(&(sr->nat), ip_packet->ip_dst, tcp_hdr->dst_port, nat_mapping_tcp);
                 if (nat_lookup != NULL) {
                     printf("[NAT TCP] Found mapping in table, good.\n");
+                  /* Patch the tcp checksum for the new pseudo header address and port */
+                  ip_sum_diff = cksum_diff32(0, ip_packet->ip_dst, nat_lookup->ip_int);
+                  tcp_hdr->checksum = cksum_adjust(tcp_hdr->checksum,
+                                                   cksum_diff16(ip_sum_diff, tcp_hdr->dst_port, nat_lookup->aux_int));
+
                     ip_packet->ip_dst = nat_lookup->ip_int;
                   tcp_hdr->dst_port = nat_lookup->aux_int;
 
-                  /*ipHdr->ip_sum = ip_cksum(ipHdr, sizeof(sr_ip_hdr_t));
-                  tcp_hdr->sum = tcp_cksum(ipHdr, tcp_hdr, len);*/
-                  tcp_hdr->checksum = 0;
-                  tcp_hdr->checksum = cksum(tcp_hdr, len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t));
-
                   
 
-                  /* Critical section, make sure you lock, careful modifying code under critical section. */
-                  pthread_mutex_lock(&((sr->nat).lock));
-
-                  struct sr_nat_connection *tcp_con = sr_nat_lookup_tcp_con(nat_lookup, ip_packet->ip_src);
+                  /* Critical section, careful modifying code under critical section. */
+                  struct sr_nat_connection *tcp_con = sr_nat_lookup_tcp_con(&(sr->nat), nat_lookup, ip_packet->ip_src, tcp_hdr->src_port);
                   if (tcp_con == NULL) {
                     printf("[NAT TCP] New conn, inserting..\n");
-                    tcp_con = sr_nat_insert_tcp_con(nat_lookup, ip_packet->ip_src);
+                    tcp_con = sr_nat_insert_tcp_con(&(sr->nat), nat_lookup, ip_packet->ip_src, tcp_hdr->src_port);
+                    if (tcp_con == NULL) {
+                      sr_nat_release_mapping(&(sr->nat), nat_lookup);
+                      printf("[NAT TCP] No room for connection, drop it\n");
+                      return -1;
+                    }
                     /*
                     TCPEndpointIndependentFiltering [MAX_POINTS = 1]: Client sends a TCP SYN packet to one of the external host(exho1). Get a new mapping (internal port#, internal IP)<=>(external port#, external IP) (Let’s call the external pair Pext). After that, another external host(exho2) sends a TCP SYN packet using Pext as destination (port#, IP) pair. 
 Check : a TCP packet should be sent out via NAT internal interface with correct destination port#.*/
@@ -272,7 +298,6 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
                         }
                     }*/
                   }
-                  tcp_con->last_updated = time(NULL);
 
 
                   switch (tcp_con->tcp_state) {
@@ -302,10 +327,15 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
                             printf("[NAT TCP] port < 1024, no need to drop...\n");
                         }*/
 
+                      }else if (tcp_hdr->rst) {
+                        printf("[NAT TCP] SYN refused by server\n");
+                        sr_nat_track_close(tcp_con, ip_packet, 0);
+                        break;
                       }else{
                         printf("[NAT TCP] 2-SYN-ACK:fucked up;; \n");
                         /*tcp_con->tcp_state = CLOSED;
                         return -1;*/
+                        sr_nat_release_mapping(&(sr->nat), nat_lookup);
                         return sendICMPmessage(sr, 3, 3, interface, packet);
                         
                       }
@@ -318,6 +348,7 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
 
                     case ESTABLISHED:
                         printf("[NAT TCP] SERVER->ROUNTER.. ESTABLISHED.. http \n");
+                        sr_nat_track_close(tcp_con, ip_packet, 0);
                         break;
 
                     default: 
@@ -333,14 +364,15 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
                             }
                         }*/
 
-                      printf("[NAT TCP] SERVER->ROUNTER.. DEFAULT.. why \n");
-                      print_hdrs(packet, len);
+                      /* Closing, or a late segment in TIME_WAIT */
+                      printf("[NAT TCP] SERVER->ROUNTER.. closing\n");
                      /* return sendICMPmessage(sr, 3, 3, interface, packet);*/
-
+                      sr_nat_track_close(tcp_con, ip_packet, 0);
                       break;
                   }
+                  sr_nat_update_tcp_con(&(sr->nat), tcp_con);
 
-                  pthread_mutex_unlock(&((sr->nat).lock));
+                  sr_nat_release_mapping(&(sr->nat), nat_lookup);
                   /* End of critical section. */
 
                   
@@ -358,9 +390,13 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
                     if (ntohl(tcp_hdr->ack_num) == 0 && tcp_hdr->syn && !tcp_hdr->ack){
                         if(ntohs(tcp_hdr->dst_port) >= 1024){
 
-                            printf("[NAT TCP] ICMP port unreachable\n");
-                            sleep(6);
-                            return sendICMPmessage(sr, 3, 3, interface, packet);
+                            /* Answered from the nat timeout thread in 6s unless
+                               the internal host opens the same connection */
+                            printf("[NAT TCP] Unsolicited SYN, parking it\n");
+                            if (sr_nat_park_syn(&(sr->nat), packet, len, interface) != 0) {
+                                printf("[NAT TCP] Cannot park the SYN, drop it\n");
+                            }
+                            return 0;
                         }else{
                             printf("[NAT TCP] port < 1024, no need to drop...\n");
                             return sendICMPmessage(sr, 3, 3, interface, packet);
@@ -369,8 +405,27 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
                     return sendICMPmessage(sr, 3, 3, interface, packet);
 
                 }
+            /* UDP */
+            }else if(ip_proto == ip_protocol_udp){
+                printf("[NAT UDP] Packet from SERVER to INTERNAL HOST\n");
+                sr_udp_hdr_t *udp_hdr = (sr_udp_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+
+                struct sr_nat_mapping *nat_entry = sr_nat_acquire_external(&(sr->nat), ip_packet->ip_dst, udp_hdr->dst_port, nat_mapping_udp);
+                if (nat_entry == NULL) {
+                    printf("[NAT UDP] No mapping, port unreachable\n");
+                    return sendICMPmessage(sr, 3, 3, interface, packet);
+                }
+
+                /* Patch the udp checksum for the new pseudo header address and port */
+                ip_sum_diff = cksum_diff32(0, ip_packet->ip_dst, nat_entry->ip_int);
+                udp_hdr->checksum = cksum_adjust_udp(udp_hdr->checksum,
+                                                     cksum_diff16(ip_sum_diff, udp_hdr->dst_port, nat_entry->aux_int));
+                ip_packet->ip_dst = nat_entry->ip_int;
+                udp_hdr->dst_port = nat_entry->aux_int;
+                sr_nat_release_mapping(&(sr->nat), nat_entry);
+
             }else{
-                printf("This is a UDP or other types of pakcet.. drop it.. \n");
+                printf("This is not a ICMP, TCP or UDP pakcet.. drop it.. \n");
                 return 0;
             }
             /* Check if Routing Table has entry for targeted ip addr */
@@ -387,22 +442,22 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
                 /* Locate the icmp header.. */
                 /*sr_icmp_hdr_t *icmp_hdr = (sr_icmp_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));*/
 
-                /* Adjust TTL and checksum */
-                ip_packet->ip_ttl --;
-                ip_packet->ip_sum = 0;
-                ip_packet->ip_sum = cksum((uint8_t *) ip_packet, sizeof(sr_ip_hdr_t));
+                /* Adjust TTL and checksum, together with the NAT rewrite */
+                ip_decrement_ttl(ip_packet, ip_sum_diff);
                 
                 
-                /* Check ARP cache, see hit or miss, like can we find the MAC addr.. */
-                struct sr_arpcache *cache = &(sr->cache);
+                /* Use the next hop's Ethernet header if ARP resolved it */
                 /*struct in_addr gw;
                 inet_aton("10.0.1.100 ",&gw);
                 matching_entry->gw = gw;*/
-                struct sr_arpentry* arpentry = sr_arpcache_lookup(cache, (uint32_t)((matching_entry->gw).s_addr));
+                struct sr_adj *adj = sr_adj_get(sr, matching_entry);
+                if (adj == NULL){
+                    return -1;
+                }
      
 
                 /* Miss ARP */
-                if (arpentry == NULL){
+                if (!sr_adj_header(adj, packet)){
                     printf("Miss in ARP cache table..\n");
                     /* Send ARP request for 5 times. 
                     If no response, send ICMP host Unreachable.*/
@@ -416,14 +471,8 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
                 }else{/* Hit */
                     printf("Hit in ARP cahce table...\n");
 
-                    /* Adjust ethernet packet and forward to next-hop */
-                    memcpy(((sr_ethernet_hdr_t *)packet)->ether_dhost, (uint8_t *) arpentry->mac, ETHER_ADDR_LEN);
-                    /*struct sr_if* forward_src_iface = sr_get_interface(sr, matching_entry->interface);*/
-                    struct sr_if* forward_src_iface = sr_get_interface(sr, matching_entry->interface);
-                    memcpy(((sr_ethernet_hdr_t *)packet)->ether_shost, forward_src_iface->addr, ETHER_ADDR_LEN);
-                    free(arpentry);
-              
-                    return sr_send_packet(sr,packet, len, matching_entry->interface);
+                    /* Ethernet header is in place, forward to next-hop */
+                    return sr_send_packet(sr,packet, len, adj->iface->name);
                 }
             }else{/* No match in routing table */
                 printf("Did not find target ip in rtable..\n");
@@ -459,41 +508,47 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
             /* Locate icmp header.. */
             sr_icmp_t3_hdr_t *icmp_hdr = (sr_icmp_t3_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
 
-            /* Look up external addr/port pair given internal info */
-            struct sr_nat_mapping *nat_entry = sr_nat_lookup_internal(&(sr->nat), ip_packet->ip_src, icmp_hdr->identifier, nat_mapping_icmp);
-
-            /* No mapping found.. */
-            if (nat_entry == NULL) {
-                printf("[NAT ICMP] making entry\n");
-                /* Insert mapping entry with internal source ip and icmp id */
-                nat_entry = sr_nat_insert_mapping(&(sr->nat), ip_packet->ip_src, icmp_hdr->identifier, nat_mapping_icmp);
+            /* An internal host's error about a packet that came in through us */
+            if (sr_nat_is_icmp_error(icmp_hdr->icmp_type)) {
+                if (sr_nat_icmp_error(sr, packet, len, 0, &ip_sum_diff) != 0) {
+                    printf("[NAT ICMP] error for an unknown flow, drop it\n");
+                    return -1;
+                }
+            }else{
+                /* Look up external addr/port pair given internal info */
+                struct sr_nat_mapping *nat_entry = sr_nat_acquire_internal(&(sr->nat), ip_packet->ip_src, icmp_hdr->identifier, nat_mapping_icmp);
 
-                /* Add external ip(eth2) and port to mapping entry */
-                nat_entry->ip_ext = forward_src_iface->ip;
+                /* No mapping found.. */
+                if (nat_entry == NULL) {
+                    printf("[NAT ICMP] making entry\n");
+                    /* Insert mapping entry with internal source ip, icmp id and external ip(eth2) */
+                    nat_entry = sr_nat_acquire_new(&(sr->nat), ip_packet->ip_src, icmp_hdr->identifier, forward_src_iface->ip, nat_mapping_icmp);
+                    if (nat_entry == NULL) {
+                        if (sr_nat_over_quota(&(sr->nat), ip_packet->ip_src, nat_mapping_icmp)) {
+                            printf("[NAT ICMP] host over its quota, administratively prohibited\n");
+                            return sendICMPmessage(sr, 3, 13, interface, packet);
+                        }
+                        printf("[NAT ICMP] no external id left, drop it\n");
+                        return -1;
+                    }
+                    printf("eth2 ip is...\n");
+                    print_addr_ip_int(forward_src_iface->ip);
+                }else{
+                    printf("[NAT icmp]Found a matching entry..\n");
+                }
+                /* Update the packet info to external addr and port, only the id is
+                   covered by the icmp checksum */
+                icmp_hdr->icmp_sum = cksum_adjust(icmp_hdr->icmp_sum,
+                                                  cksum_diff16(0, icmp_hdr->identifier, nat_entry->aux_ext));
+                icmp_hdr->identifier = nat_entry->aux_ext;
+                ip_sum_diff = cksum_diff32(0, ip_packet->ip_src, nat_entry->ip_ext);
+                ip_packet->ip_src = nat_entry->ip_ext;
+                sr_nat_release_mapping(&(sr->nat), nat_entry);
                 printf("eth2 ip is...\n");
-                print_addr_ip_int(forward_src_iface->ip);
-                /* Generate a random port for the entry for external info */
-                nat_entry->aux_ext = htons((uint16_t) generate_unique_port(&(sr->nat)));
-            }else{
-                printf("[NAT icmp]Found a matching entry..\n");
+                print_addr_ip_int(ntohl(ip_packet->ip_src));
             }
-            /* Update this entry */
-            nat_entry->last_updated = time(NULL);
-            /* Update the packet info to external addr and port */
-            /*int diff = (int)icmp_hdr->identifier - (int)nat_entry->aux_ext;*/
-            icmp_hdr->identifier = nat_entry->aux_ext;
-            ip_packet->ip_src = nat_entry->ip_ext;
-            printf("eth2 ip is...\n");
-            print_addr_ip_int(ntohl(ip_packet->ip_src));
             /*printf("After NAT... headers like this\n");
             print_hdrs(packet,len);*/
-            icmp_hdr->icmp_sum = 0;
-            icmp_hdr->icmp_sum = cksum(icmp_hdr, len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t));
-
-           /* int icmpOffset = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t);*/
-            
-            /*icmp_hdr->icmp_sum = (uint16_t) ((int) icmp_hdr->icmp_sum - diff);*/
-
             
 
         /* TCP */
@@ -506,41 +561,63 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
                 return sendICMPmessage(sr, 3, 3, interface, packet);
             }
 
-            struct sr_nat_mapping *nat_entry = sr_nat_lookup_internal(&(sr->nat), ip_packet->ip_src, tcp_hdr->src_port, nat_mapping_tcp);
+            /* Critical section: the mapping stays locked until it is released below,
+               careful modifying code under critical section. */
+            struct sr_nat_mapping *nat_entry = sr_nat_acquire_internal(&(sr->nat), ip_packet->ip_src, tcp_hdr->src_port, nat_mapping_tcp);
 
             if (nat_entry == NULL) {
                 printf("[NAT TCP: Didn't find mapping, make one]\n");
-              nat_entry  = sr_nat_insert_mapping(&(sr->nat), ip_packet->ip_src, tcp_hdr->src_port, nat_mapping_tcp);
-              /* Add external ip(eth2) and port to mapping entry */
-                nat_entry->ip_ext = forward_src_iface->ip;
+              /* External ip(eth2) goes in with the mapping, the port is allocated on insert */
+              nat_entry  = sr_nat_acquire_new(&(sr->nat), ip_packet->ip_src, tcp_hdr->src_port, forward_src_iface->ip, nat_mapping_tcp);
+                if (nat_entry == NULL) {
+                    if (sr_nat_over_quota(&(sr->nat), ip_packet->ip_src, nat_mapping_tcp)) {
+                        printf("[NAT TCP] host over its quota, administratively prohibited\n");
+                        return sendICMPmessage(sr, 3, 13, interface, packet);
+                    }
+                    printf("[NAT TCP] no external port left, drop it\n");
+                    return -1;
+                }
                 printf("eth2 ip is...\n");
                 print_addr_ip_int(ntohl(forward_src_iface->ip));
-                /* Generate a random port for the entry for external info */
-                nat_entry->aux_ext = htons((uint16_t) generate_unique_port(&(sr->nat)));
             }else{
                 printf("[NAT TCP: Found a entry]\n");
             }
-            nat_entry->last_updated = time(NULL);
-
-            /* Critical section, make sure you lock, careful modifying code under critical section. */
-            pthread_mutex_lock(&((sr->nat).lock));
 
             /* Look up tcp connection for this mapping */
-            struct sr_nat_connection *tcp_con = sr_nat_lookup_tcp_con(nat_entry, ip_packet->ip_dst);
+            struct sr_nat_connection *tcp_con = sr_nat_lookup_tcp_con(&(sr->nat), nat_entry, ip_packet->ip_dst, tcp_hdr->dst_port);
             if (tcp_con == NULL) {
                 /* Insert the connection .. */
                 printf("[NAT TCP: NO conn found, insert this]\n");
-                tcp_con = sr_nat_insert_tcp_con(nat_entry, ip_packet->ip_dst);
+                tcp_con = sr_nat_insert_tcp_con(&(sr->nat), nat_entry, ip_packet->ip_dst, tcp_hdr->dst_port);
+                if (tcp_con == NULL) {
+                    sr_nat_release_mapping(&(sr->nat), nat_entry);
+                    printf("[NAT TCP] No room for connection, drop it\n");
+                    return -1;
+                }
             }else{
                 printf("[NAT TCP: found Existing COnn]\n");
             }
-            tcp_con->last_updated = time(NULL);
 
             switch (tcp_con->tcp_state) {
+              case TIME_WAIT:
+                if (!(tcp_hdr->syn && !tcp_hdr->ack)) {
+                    sr_nat_track_close(tcp_con, ip_packet, 1);
+                    break;
+                }
+                /* Same peer and port again: a new connection */
+                printf("[NAT TCP] SYN in TIME_WAIT, reopening\n");
+                sr_nat_reopen_tcp_con(tcp_con);
+                /* fall through */
               case CLOSED:
                 /*1）---SYN----*/
                 if (ntohl(tcp_hdr->ack_num) == 0 && tcp_hdr->syn && !tcp_hdr->ack) {
                     printf("[NAT TCP: (1)SYN-Opening the handshake.]\n");
+                  if (sr_nat_halfopen_full(&(sr->nat), nat_entry)) {
+                      printf("[NAT TCP] host has too many half-open connections, administratively prohibited\n");
+                      sr_nat_release_mapping(&(sr->nat), nat_entry);
+                      return sendICMPmessage(sr, 3, 13, interface, packet);
+                  }
+                  sr_nat_cancel_syn(&(sr->nat), nat_entry, ip_packet->ip_dst, tcp_hdr->dst_port);
                   /*tcp_con->client_isn = ntohl(tcp_hdr->seq_num);*/
                   tcp_con->client_isn = tcp_hdr->seq;
                   tcp_con->tcp_state = SYN_SENT;
@@ -567,6 +644,7 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
                     printf("[NAT] Unsolicited SYN packet.. \n");
                     double diff_t;
                     diff_t = difftime(time(NULL), tcp_con->last_updated );
+                    sr_nat_release_mapping(&(sr->nat), nat_entry);
                     if((int)diff_t < 6){
                         printf("[NAT] Unsolicited SYN packet.. drop it.. <6\n");
                         return -1;
@@ -576,6 +654,9 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
                         return -1;
                     }
 
+                }else if (tcp_hdr->rst) {
+                    printf("[NAT TCP] Client reset the handshake\n");
+                    sr_nat_track_close(tcp_con, ip_packet, 1);
                 }else{
                     printf("[NAT TCP: I am fucked up here!!!\n");
                     printf("(ntohl(tcp_hdr->seq_num) == ntohl(tcp_con->client_isn) + 1): ->%d\n", (ntohl(tcp_hdr->seq) == ntohl(tcp_con->client_isn) + 1));
@@ -586,10 +667,10 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
                 break;
 
               case ESTABLISHED:
-                if (tcp_hdr->fin && tcp_hdr->ack) {
+                if (tcp_hdr->fin || tcp_hdr->rst) {
                     printf("[NAT TCP: Client to Server: closing connection]\n");
                   tcp_con->client_isn = tcp_hdr->seq;
-                  tcp_con->tcp_state = CLOSED;
+                  sr_nat_track_close(tcp_con, ip_packet, 1);
                 }else{
                     printf("[NAT TCP ESTABLISHED: HTTP\n");
     
@@ -598,21 +679,49 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
                 break;
 
               default:
+              /* Closing or handshaking, only FIN and RST move us on */
               printf("[NAT TCP] INTERNAL -> SERVER: DEFAULT...\n");
-              print_hdrs(packet, len);
+              sr_nat_track_close(tcp_con, ip_packet, 1);
                 break;
             }
+            sr_nat_update_tcp_con(&(sr->nat), tcp_con);
 
-            pthread_mutex_unlock(&((sr->nat).lock));
-            /* End of critical section. */
+            /* Patch the tcp checksum for the new pseudo header address and port */
+            ip_sum_diff = cksum_diff32(0, ip_packet->ip_src, nat_entry->ip_ext);
+            tcp_hdr->checksum = cksum_adjust(tcp_hdr->checksum,
+                                             cksum_diff16(ip_sum_diff, tcp_hdr->src_port, nat_entry->aux_ext));
 
             ip_packet->ip_src = nat_entry->ip_ext;
             tcp_hdr->src_port = nat_entry->aux_ext;
 
-            /*ipHdr->ip_sum = ip_cksum(ipHdr, sizeof(sr_ip_hdr_t));*/
-            tcp_hdr->checksum = 0;
-            tcp_hdr->checksum= cksum(tcp_hdr, len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t));
+            sr_nat_release_mapping(&(sr->nat), nat_entry);
+            /* End of critical section. */
             
+        /* UDP */
+        }else if(ip_proto == ip_protocol_udp){
+            printf("[NAT UDP: from internal to server]\n");
+            sr_udp_hdr_t *udp_hdr = (sr_udp_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+
+            struct sr_nat_mapping *nat_entry = sr_nat_acquire_internal(&(sr->nat), ip_packet->ip_src, udp_hdr->src_port, nat_mapping_udp);
+            if (nat_entry == NULL) {
+                nat_entry = sr_nat_acquire_new(&(sr->nat), ip_packet->ip_src, udp_hdr->src_port, forward_src_iface->ip, nat_mapping_udp);
+                if (nat_entry == NULL) {
+                    if (sr_nat_over_quota(&(sr->nat), ip_packet->ip_src, nat_mapping_udp)) {
+                        printf("[NAT UDP] host over its quota, administratively prohibited\n");
+                        return sendICMPmessage(sr, 3, 13, interface, packet);
+                    }
+                    printf("[NAT UDP] no external port left, drop it\n");
+                    return -1;
+                }
+            }
+
+            /* Patch the udp checksum for the new pseudo header address and port */
+            ip_sum_diff = cksum_diff32(0, ip_packet->ip_src, nat_entry->ip_ext);
+            udp_hdr->checksum = cksum_adjust_udp(udp_hdr->checksum,
+                                                 cksum_diff16(ip_sum_diff, udp_hdr->src_port, nat_entry->aux_ext));
+            ip_packet->ip_src = nat_entry->ip_ext;
+            udp_hdr->src_port = nat_entry->aux_ext;
+            sr_nat_release_mapping(&(sr->nat), nat_entry);
         }
         
         /* Check if Routing Table has entry for targeted ip addr */
@@ -625,20 +734,20 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
                 /* Locate the icmp header.. */
                 /*sr_icmp_hdr_t *icmp_hdr = (sr_icmp_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));*/
 
-                /* Adjust TTL and checksum */
-                ip_packet->ip_ttl --;
-                ip_packet->ip_sum = 0;
-                ip_packet->ip_sum = cksum((uint8_t *) ip_packet, sizeof(sr_ip_hdr_t));
+                /* Adjust TTL and checksum, together with the NAT rewrite */
+                ip_decrement_ttl(ip_packet, ip_sum_diff);
                 
                 
                 printf("[NAT}Found entry in routing table.\n");
-                /* Check ARP cache, see hit or miss, like can we find the MAC addr.. */
-                struct sr_arpcache *cache = &(sr->cache);
-                struct sr_arpentry* arpentry = sr_arpcache_lookup(cache, (uint32_t)((matching_entry->gw).s_addr));
+                /* Use the next hop's Ethernet header if ARP resolved it */
+                struct sr_adj *adj = sr_adj_get(sr, matching_entry);
+                if (adj == NULL){
+                    return -1;
+                }
          
 
             /* Miss ARP */
-            if (arpentry == NULL){
+            if (!sr_adj_header(adj, packet)){
                 printf("[NAT}Miss in ARP cache table..\n");
                 /* Send ARP request for 5 times. 
                  If no response, send ICMP host Unreachable.*/
@@ -652,16 +761,230 @@ Check : a TCP packet should be sent out via NAT internal interface with correct
             }else{/* Hit */
                 printf("[NAT]Hit in ARP cahce table...\n");
 
-                /* Adjust ethernet packet and forward to next-hop */
-                memcpy(((sr_ethernet_hdr_t *)packet)->ether_dhost, (uint8_t *) arpentry->mac, ETHER_ADDR_LEN);
-                struct sr_if* forward_src_iface = sr_get_interface(sr, matching_entry->interface);
-                memcpy(((sr_ethernet_hdr_t *)packet)->ether_shost, forward_src_iface->addr, ETHER_ADDR_LEN);
-                free(arpentry);
-              
-                return sr_send_packet(sr,packet, len, matching_entry->interface);
+                /* Ethernet header is in place, forward to next-hop */
+                return sr_send_packet(sr,packet, len, adj->iface->name);
+            }
+
+        }
+    }
+    return 0;
+}
+
+/* Hairpin a TCP/UDP packet from an internal host to the public address
+   and port of another one. The destination is found with one lookup in
+   the external index, the source gets its own mapping as for any
+   outbound packet, both held together while their connections are
+   tracked, and both rewrites go into a single checksum update
+   before the packet goes straight back out the internal interface. */
+int sr_nat_hairpin(struct sr_instance* sr,
+        uint8_t * packet,
+        unsigned int len,
+        char* interface){
+
+    sr_ip_hdr_t *ip_packet = (sr_ip_hdr_t*) (packet + sizeof(sr_ethernet_hdr_t));
+    uint8_t ip_proto = ip_protocol((uint8_t *) ip_packet);
+    /* tcp and udp ports sit at the same place */
+    sr_udp_hdr_t *ports = (sr_udp_hdr_t *) ((uint8_t *) ip_packet + ip_packet->ip_hl * 4);
+    sr_tcp_hdr_t *tcp_hdr = (sr_tcp_hdr_t *) ports;
+    sr_nat_mapping_type type = (ip_proto == ip_protocol_tcp) ? nat_mapping_tcp : nat_mapping_udp;
+    struct sr_if* ext_iface = sr_get_interface(sr, NAT_EXTERNAL_INTERFACE);
+    struct sr_nat_mapping *src, *dst;
+    struct sr_nat_connection *tcp_con;
+    uint32_t src_ip, dst_ip;
+    uint16_t src_port, dst_port;
+    uint32_t ip_sum_diff;
+
+    if(ip_packet->ip_ttl == 1 || ip_packet->ip_ttl == 0){
+        return sendICMPmessage(sr, 11, 0, interface, packet);
+    }
+    printf("[NAT] Hairpin from internal host to a public address\n");
+
+    /* Both sides under one acquire, so neither mapping can go away
+       between the two translations */
+    if (sr_nat_acquire_hairpin(&(sr->nat), ip_packet->ip_src, ports->src_port,
+                               ext_iface ? ext_iface->ip : 0, ip_packet->ip_dst,
+                               ports->dst_port, type, &src, &dst) != 0) {
+        if (dst == NULL) {
+            printf("[NAT] Hairpin: nobody behind that port\n");
+            return sendICMPmessage(sr, 3, 3, interface, packet);
+        }
+        if (sr_nat_over_quota(&(sr->nat), ip_packet->ip_src, type)) {
+            return sendICMPmessage(sr, 3, 13, interface, packet);
+        }
+        printf("[NAT] Hairpin: no external port left, drop it\n");
+        return -1;
+    }
+    if (type == nat_mapping_tcp) {
+        /* Source side, as for any outbound packet */
+        tcp_con = sr_nat_lookup_tcp_con(&(sr->nat), src, ip_packet->ip_dst, ports->dst_port);
+        if (tcp_con == NULL) {
+            if (tcp_hdr->syn && !tcp_hdr->ack && sr_nat_halfopen_full(&(sr->nat), src)) {
+                sr_nat_release_mapping(&(sr->nat), dst);
+                sr_nat_release_mapping(&(sr->nat), src);
+                return sendICMPmessage(sr, 3, 13, interface, packet);
             }
+            tcp_con = sr_nat_insert_tcp_con(&(sr->nat), src, ip_packet->ip_dst, ports->dst_port);
+        }
+        if (tcp_con != NULL) {
+            sr_nat_track_hairpin(tcp_con, ip_packet, 1);
+            sr_nat_update_tcp_con(&(sr->nat), tcp_con);
+        }
+
+        /* Destination side, as seen from the source's public address */
+        tcp_con = sr_nat_lookup_tcp_con(&(sr->nat), dst, src->ip_ext, src->aux_ext);
+        if (tcp_con == NULL) {
+            tcp_con = sr_nat_insert_tcp_con(&(sr->nat), dst, src->ip_ext, src->aux_ext);
+        }
+        if (tcp_con != NULL) {
+            sr_nat_track_hairpin(tcp_con, ip_packet, 0);
+            sr_nat_update_tcp_con(&(sr->nat), tcp_con);
+        }
+    }
+    src_ip = src->ip_ext;
+    src_port = src->aux_ext;
+    dst_ip = dst->ip_int;
+    dst_port = dst->aux_int;
+    sr_nat_release_mapping(&(sr->nat), dst);
+    sr_nat_release_mapping(&(sr->nat), src);
+
+    /* Both addresses and ports in one checksum update */
+    ip_sum_diff = cksum_diff32(0, ip_packet->ip_src, src_ip);
+    ip_sum_diff = cksum_diff32(ip_sum_diff, ip_packet->ip_dst, dst_ip);
+    if (type == nat_mapping_tcp) {
+        tcp_hdr->checksum = cksum_adjust(tcp_hdr->checksum,
+                                         cksum_diff16(cksum_diff16(ip_sum_diff, ports->src_port, src_port),
+                                                      ports->dst_port, dst_port));
+    } else {
+        ports->checksum = cksum_adjust_udp(ports->checksum,
+                                           cksum_diff16(cksum_diff16(ip_sum_diff, ports->src_port, src_port),
+                                                        ports->dst_port, dst_port));
+    }
+    ip_packet->ip_src = src_ip;
+    ip_packet->ip_dst = dst_ip;
+    ports->src_port = src_port;
+    ports->dst_port = dst_port;
+    ip_decrement_ttl(ip_packet, ip_sum_diff);
+
+    struct sr_rt* matching_entry = longest_prefix_match(sr, ip_packet->ip_dst);
+    if(matching_entry == NULL){
+        return sendICMPmessage(sr, 3, 0, interface, packet);
+    }
+    struct sr_adj *adj = sr_adj_get(sr, matching_entry);
+    if (adj == NULL){
+        return -1;
+    }
+    if (!sr_adj_header(adj, packet)){
+        sr_arpcache_queuereq(&(sr->cache),(uint32_t)((matching_entry->gw).s_addr),packet,
+                             len,interface);
+        return 0;
+    }
+
+    return sr_send_packet(sr, packet, len, adj->iface->name);
+}
 
+/* Destination unreachable, source quench, time exceeded and parameter
+   problem quote the packet that caused them. */
+int sr_nat_is_icmp_error(uint8_t icmp_type){
+    return icmp_type == 3 || icmp_type == 4 || icmp_type == 11 || icmp_type == 12;
+}
+
+/* Translate an ICMP error for the flow of the packet it quotes. Inbound,
+   the quoted packet is one we sent out, so its source (address and port,
+   or echo id) is looked up in the external index and put back to the
+   internal host's, along with the outer destination. Outbound, the quoted
+   packet came in through us: its destination and the outer source go to
+   the external side. Every checksum the quote carries (ip header,
+   udp/tcp if it fits, echo) and the icmp checksum over all of it are
+   patched incrementally; the outer ip header change is left in
+   ip_sum_diff for the ttl update. Returns -1 if no mapping matches. */
+int sr_nat_icmp_error(struct sr_instance* sr,
+        uint8_t * packet,
+        unsigned int len,
+        int inbound,
+        uint32_t *ip_sum_diff){
+
+    sr_ip_hdr_t *ip_packet = (sr_ip_hdr_t*) (packet + sizeof(sr_ethernet_hdr_t));
+    uint8_t *end = packet + len;
+    sr_icmp_hdr_t *icmp_hdr = (sr_icmp_hdr_t *) ((uint8_t *) ip_packet + ip_packet->ip_hl * 4);
+    /* The quote starts after type, code, checksum and 4 unused bytes */
+    sr_ip_hdr_t *inner = (sr_ip_hdr_t *) ((uint8_t *) icmp_hdr + 8);
+    /* Fields of the quote are reached by offset, they need not be aligned */
+    uint8_t *l4, *addr_p, *aux_p, *sum_p = NULL;
+    uint32_t old_addr, new_addr, acc, icmp_acc;
+    uint16_t old_aux, new_aux, old_sum, new_sum;
+    sr_nat_mapping_type type;
+    struct sr_nat_mapping *mapping;
+
+    /* Only a whole ipv4 header and the 8 bytes after it can be translated */
+    if ((uint8_t *) inner + sizeof(sr_ip_hdr_t) > end ||
+        inner->ip_v != 4 || inner->ip_hl < 5 ||
+        (uint8_t *) inner + inner->ip_hl * 4 + 8 > end) {
+        return -1;
+    }
+    l4 = (uint8_t *) inner + inner->ip_hl * 4;
+
+    /* Our side of the quoted packet: its source inbound, destination outbound */
+    addr_p = (uint8_t *) inner + (inbound ? offsetof(sr_ip_hdr_t, ip_src) : offsetof(sr_ip_hdr_t, ip_dst));
+    if (inner->ip_p == ip_protocol_tcp || inner->ip_p == ip_protocol_udp) {
+        type = (inner->ip_p == ip_protocol_tcp) ? nat_mapping_tcp : nat_mapping_udp;
+        aux_p = l4 + (inbound ? offsetof(sr_udp_hdr_t, src_port) : offsetof(sr_udp_hdr_t, dst_port));
+        if (type == nat_mapping_udp) {
+            sum_p = l4 + offsetof(sr_udp_hdr_t, checksum);
+        } else if (l4 + offsetof(sr_tcp_hdr_t, checksum) + 2 <= end) {
+            sum_p = l4 + offsetof(sr_tcp_hdr_t, checksum);
         }
+    } else if (inner->ip_p == ip_protocol_icmp && !sr_nat_is_icmp_error(l4[0])) {
+        type = nat_mapping_icmp;
+        aux_p = l4 + offsetof(sr_icmp_t3_hdr_t, identifier);
+        sum_p = l4 + offsetof(sr_icmp_hdr_t, icmp_sum);
+    } else {
+        return -1;
+    }
+    memcpy(&old_addr, addr_p, sizeof(old_addr));
+    memcpy(&old_aux, aux_p, sizeof(old_aux));
+
+    if (inbound) {
+        mapping = sr_nat_acquire_external(&(sr->nat), old_addr, old_aux, type);
+    } else {
+        mapping = sr_nat_acquire_internal(&(sr->nat), old_addr, old_aux, type);
+    }
+    if (mapping == NULL) {
+        return -1;
+    }
+    new_addr = inbound ? mapping->ip_int : mapping->ip_ext;
+    new_aux = inbound ? mapping->aux_int : mapping->aux_ext;
+    sr_nat_release_mapping(&(sr->nat), mapping);
+
+    /* Quoted ip header */
+    acc = cksum_diff32(0, old_addr, new_addr);
+    icmp_acc = acc;
+    old_sum = inner->ip_sum;
+    inner->ip_sum = cksum_adjust(inner->ip_sum, acc);
+    icmp_acc = cksum_diff16(icmp_acc, old_sum, inner->ip_sum);
+
+    /* Quoted transport header, the echo checksum has no pseudo header */
+    if (type == nat_mapping_icmp) {
+        acc = 0;
+    }
+    acc = cksum_diff16(acc, old_aux, new_aux);
+    icmp_acc = cksum_diff16(icmp_acc, old_aux, new_aux);
+    if (sum_p != NULL) {
+        memcpy(&old_sum, sum_p, sizeof(old_sum));
+        new_sum = (type == nat_mapping_udp) ? cksum_adjust_udp(old_sum, acc) : cksum_adjust(old_sum, acc);
+        memcpy(sum_p, &new_sum, sizeof(new_sum));
+        icmp_acc = cksum_diff16(icmp_acc, old_sum, new_sum);
+    }
+    icmp_hdr->icmp_sum = cksum_adjust(icmp_hdr->icmp_sum, icmp_acc);
+    memcpy(addr_p, &new_addr, sizeof(new_addr));
+    memcpy(aux_p, &new_aux, sizeof(new_aux));
+
+    /* Outer header */
+    if (inbound) {
+        *ip_sum_diff = cksum_diff32(0, ip_packet->ip_dst, new_addr);
+        ip_packet->ip_dst = new_addr;
+    } else {
+        *ip_sum_diff = cksum_diff32(0, ip_packet->ip_src, new_addr);
+        ip_packet->ip_src = new_addr;
     }
     return 0;
 }
@@ -691,10 +1014,11 @@ int sr_handleIPpacket(struct sr_instance* sr,
             
             struct sr_arpcache *cache = &(sr->cache);
             struct sr_rt* matching_entry = longest_prefix_match1(sr, ip_packet->ip_src);
-            struct sr_arpentry* arpentry = sr_arpcache_lookup(cache, (uint32_t)((matching_entry->gw).s_addr));
+            unsigned char arp_mac[ETHER_ADDR_LEN];
+            int arp_hit = sr_arpcache_lookup_mac(cache, (uint32_t)((matching_entry->gw).s_addr), arp_mac);
             
-            if(arpentry != NULL){/* Find ARP cache matching the echo req src*/
-                return send_echo_reply(sr, interface, packet, len, arpentry);
+            if(arp_hit){/* Find ARP cache matching the echo req src*/
+                return send_echo_reply(sr, interface, packet, len, arp_mac);
             }else{/* Send ARP req to find the echo req src MAC addr*/
                 sr_arpcache_queuereq(&(sr->cache),(uint32_t)((matching_entry->gw).s_addr),packet,len,interface);
                 return 0;
@@ -729,16 +1053,16 @@ int sr_handleIPpacket(struct sr_instance* sr,
         if(matching_entry != NULL){
 
             /* Adjust TTL and checksum */
-            ip_packet->ip_ttl --;
-            ip_packet->ip_sum = 0;
-            ip_packet->ip_sum = cksum((uint8_t *) ip_packet, sizeof(sr_ip_hdr_t));
+            ip_decrement_ttl(ip_packet, 0);
             printf("Found entry in routing table.\n");
-            /* Check ARP cache, see hit or miss, like can we find the MAC addr.. */
-            struct sr_arpcache *cache = &(sr->cache);
-            struct sr_arpentry* arpentry = sr_arpcache_lookup(cache, (uint32_t)((matching_entry->gw).s_addr));
+            /* Use the next hop's Ethernet header if ARP resolved it */
+            struct sr_adj *adj = sr_adj_get(sr, matching_entry);
+            if (adj == NULL){
+                return -1;
+            }
 
             /* Miss ARP */
-            if (arpentry == NULL){
+            if (!sr_adj_header(adj, packet)){
                 printf("Miss in ARP cache table..\n");
                 /* Send ARP request for 5 times. 
                  If no response, send ICMP host Unreachable.*/
@@ -752,13 +1076,8 @@ int sr_handleIPpacket(struct sr_instance* sr,
             }else{/* Hit */
                 printf("Hit in ARP cahce table...\n");
 
-                /* Adjust ethernet packet and forward to next-hop */
-                memcpy(((sr_ethernet_hdr_t *)packet)->ether_dhost, (uint8_t *) arpentry->mac, ETHER_ADDR_LEN);
-                struct sr_if* forward_src_iface = sr_get_interface(sr, matching_entry->interface);
-                memcpy(((sr_ethernet_hdr_t *)packet)->ether_shost, forward_src_iface->addr, ETHER_ADDR_LEN);
-                free(arpentry);
-              
-                return sr_send_packet(sr,packet, len, matching_entry->interface);
+                /* Ethernet header is in place, forward to next-hop */
+                return sr_send_packet(sr,packet, len, adj->iface->name);
             }
 
         }else{/* No match in routing table */
@@ -781,6 +1100,12 @@ int sr_handleARPpacket(struct sr_instance* sr,
     /* Get the dest ip and see which interface it is.. */
     struct sr_if *target_if = (struct sr_if*) checkDestIsIface(arp_packet->ar_tip, sr);
 
+    /* Answer for the NAT pool addresses on the external side */
+    if(target_if == 0 && sr->nat_flag && !is_nat_internal_iface(interface) &&
+       sr_nat_is_external_addr(&(sr->nat), arp_packet->ar_tip)){
+        target_if = sr_get_interface(sr, interface);
+    }
+
     /* Error check */
     if(target_if == 0){
         fprintf(stderr, "This ARP packet is not for this router.., can't be handled\n");
@@ -806,7 +1131,7 @@ int sr_handleARPpacket(struct sr_instance* sr,
         arp_reply->ar_pln = 4;             /* length of protocol address   */
         arp_reply->ar_op = htons(arp_op_reply);              /* ARP opcode (command)         */
         memcpy(arp_reply->ar_sha, target_if->addr,ETHER_ADDR_LEN);/* sender hardware address      */
-        arp_reply->ar_sip = target_if->ip;             /* sender IP address            */
+        arp_reply->ar_sip = arp_packet->ar_tip;        /* sender IP address            */
         memcpy(arp_reply->ar_tha, arp_packet->ar_sha,ETHER_ADDR_LEN);/* target hardware address      */
         arp_reply->ar_tip = arp_packet->ar_sip;
 
@@ -825,6 +1150,10 @@ int sr_handleARPpacket(struct sr_instance* sr,
         printf("Caching the ip->mac entry \n");
         struct sr_arpcache *cache = &(sr->cache);
         struct sr_arpreq *cached_req = sr_arpcache_insert(cache, arp_packet->ar_sha, arp_packet->ar_sip);
+        if (cached_req == NULL) {
+            /* Nothing was waiting on it */
+            return 0;
+        }
         
         /* send outstanding packts */
         struct sr_packet *pkt, *nxt;
@@ -912,11 +1241,11 @@ struct sr_if* checkDestIsIface(uint32_t ip, struct sr_instance* sr){
 
 
 /* Send Echo Reply back */
-int send_echo_reply(struct sr_instance* sr,char* iface, uint8_t * ori_packet, unsigned int len,struct sr_arpentry* arpentry){
+int send_echo_reply(struct sr_instance* sr,char* iface, uint8_t * ori_packet, unsigned int len,unsigned char* mac){
 
     uint8_t *temp_dhost = malloc(sizeof(uint8_t) * ETHER_ADDR_LEN);
     memcpy(temp_dhost, ((sr_ethernet_hdr_t *)ori_packet)->ether_dhost, ETHER_ADDR_LEN);
-    memcpy(((sr_ethernet_hdr_t *)ori_packet)->ether_dhost, (uint8_t *) arpentry->mac, ETHER_ADDR_LEN);
+    memcpy(((sr_ethernet_hdr_t *)ori_packet)->ether_dhost, mac, ETHER_ADDR_LEN);
     memcpy(((sr_ethernet_hdr_t *)ori_packet)->ether_shost, temp_dhost, ETHER_ADDR_LEN);
     free(temp_dhost);
 
@@ -1153,6 +1482,7 @@ struct sr_rt* sr_rt_entry(struct sr_instance* sr, char* dest, char* gw, char* ma
     rt_walker = (struct sr_rt*)malloc(sizeof(struct sr_rt));
   
     rt_walker->next = 0;
+    rt_walker->adj  = 0;
     rt_walker->dest = dest_addr;
     rt_walker->gw   = gw_addr;
     rt_walker->mask = mask_addr;
@@ -71,16 +71,19 @@ int sr_read_from_server(struct sr_instance* );
 
 /* -- sr_router.c -- */
 /*void sr_init(struct sr_instance* );*/
-void sr_init(struct sr_instance* sr, int nat, int icmp_timeout_int, int tcp_idle_timeout, int transitory_idle_timeout);
+void sr_init(struct sr_instance* sr, int nat, int icmp_timeout_int, int tcp_idle_timeout, int transitory_idle_timeout, int udp_idle_timeout);
 void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
 int sr_handleIPpacket(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
 int sr_handleARPpacket(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
 struct sr_if* checkDestIsIface(uint32_t ip, struct sr_instance* sr);
 int sendICMPmessage(struct sr_instance* sr, uint8_t icmp_type, uint8_t icmp_code, char* iface, uint8_t * ori_packet);
-int send_echo_reply(struct sr_instance* sr, char* iface, uint8_t * ori_packet, unsigned int len, struct sr_arpentry* arpentry);
+int send_echo_reply(struct sr_instance* sr, char* iface, uint8_t * ori_packet, unsigned int len, unsigned char* mac);
 struct sr_rt *longest_prefix_match(struct sr_instance* sr, uint32_t ip);
 struct sr_rt* longest_prefix_match1(struct sr_instance* sr, uint32_t ip);
 int sr_nat_handleIPpacket(struct sr_instance* sr,uint8_t * packet,unsigned int len,char* interface);
+int sr_nat_hairpin(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
+int sr_nat_is_icmp_error(uint8_t icmp_type);
+int sr_nat_icmp_error(struct sr_instance* sr, uint8_t * packet, unsigned int len, int inbound, uint32_t *ip_sum_diff);
 uint32_t icmp_cksum (sr_icmp_t3_hdr_t  *icmpHdr, int len); 
 /* -- sr_if.c -- */
 void sr_add_interface(struct sr_instance* , const char* );
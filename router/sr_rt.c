@@ -105,6 +105,7 @@ struct in_addr gw, struct in_addr mask,char* if_name)
         sr->routing_table = (struct sr_rt*)malloc(sizeof(struct sr_rt));
         assert(sr->routing_table);
         sr->routing_table->next = 0;
+        sr->routing_table->adj  = 0;
         sr->routing_table->dest = dest;
         sr->routing_table->gw   = gw;
         sr->routing_table->mask = mask;
@@ -124,6 +125,7 @@ struct in_addr gw, struct in_addr mask,char* if_name)
     rt_walker = rt_walker->next;
 
     rt_walker->next = 0;
+    rt_walker->adj  = 0;
     rt_walker->dest = dest;
     rt_walker->gw   = gw;
     rt_walker->mask = mask;
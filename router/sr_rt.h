@@ -20,6 +20,8 @@
 
 #include "sr_if.h"
 
+struct sr_adj;
+
 /* ----------------------------------------------------------------------------
  * struct sr_rt
  *
@@ -33,6 +35,7 @@ struct sr_rt
     struct in_addr gw;
     struct in_addr mask;
     char   interface[sr_IFACE_NAMELEN];
+    struct sr_adj* adj;     /* Next hop, bound on first use */
     struct sr_rt* next;
 };
 
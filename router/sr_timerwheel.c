@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sr_timerwheel.h"
+
+/* Seconds covered by levels below the given one. */
+#define LEVEL_SPAN(level) ((time_t) 1 << (SR_WHEEL_BITS * (level)))
+
+static void sr_wheel_link(struct sr_timer **slot, struct sr_timer *timer) {
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+}
+
+static void sr_wheel_unlink(struct sr_timer *timer) {
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        *(timer->slot) = timer->next;
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+    timer->next = timer->prev = NULL;
+    timer->slot = NULL;
+}
+
+/* Puts the timer in the slot matching its expiry relative to wheel->now. */
+static void sr_wheel_place(struct sr_wheel *wheel, struct sr_timer *timer) {
+    time_t expires = timer->expires;
+    time_t delta;
+    int level;
+
+    if (expires <= wheel->now) {
+        expires = wheel->now + 1;
+    }
+    delta = expires - wheel->now;
+
+    for (level = 0; level < SR_WHEEL_LEVELS - 1; level++) {
+        if (delta < LEVEL_SPAN(level + 1)) {
+            break;
+        }
+    }
+
+    /* Past the top level: park in the farthest slot, the owner re-arms
+       when it fires early. */
+    if (delta >= LEVEL_SPAN(SR_WHEEL_LEVELS)) {
+        expires = wheel->now + LEVEL_SPAN(SR_WHEEL_LEVELS) - 1;
+    }
+
+    sr_wheel_link(&(wheel->slots[level][(expires >> (SR_WHEEL_BITS * level)) & SR_WHEEL_MASK]),
+                  timer);
+}
+
+/* Moves every timer of a coarse slot down to the finer levels. */
+static void sr_wheel_cascade(struct sr_wheel *wheel, int level, int index) {
+    struct sr_timer *timer;
+
+    while ((timer = wheel->slots[level][index]) != NULL) {
+        sr_wheel_unlink(timer);
+        sr_wheel_place(wheel, timer);
+    }
+}
+
+void sr_wheel_init(struct sr_wheel *wheel, time_t now) {
+    memset(wheel, 0, sizeof(struct sr_wheel));
+    wheel->now = now;
+}
+
+void sr_timer_init(struct sr_timer *timer,
+                   void (*expire)(void *ctx, struct sr_timer *timer),
+                   void *data) {
+    memset(timer, 0, sizeof(struct sr_timer));
+    timer->expire = expire;
+    timer->data = data;
+}
+
+void sr_wheel_add(struct sr_wheel *wheel, struct sr_timer *timer, time_t expires) {
+    if (timer->slot != NULL) {
+        sr_wheel_unlink(timer);
+    }
+    timer->expires = expires;
+    sr_wheel_place(wheel, timer);
+}
+
+void sr_wheel_del(struct sr_wheel *wheel, struct sr_timer *timer) {
+    if (timer->slot != NULL) {
+        sr_wheel_unlink(timer);
+    }
+}
+
+int sr_timer_pending(struct sr_timer *timer) {
+    return timer->slot != NULL;
+}
+
+void sr_wheel_advance(struct sr_wheel *wheel, time_t now, void *ctx) {
+    struct sr_timer *timer;
+    int level, i;
+
+    /* After a long stall, re-place everything relative to the new time
+       instead of stepping through every missed second. */
+    if (now - wheel->now > LEVEL_SPAN(SR_WHEEL_LEVELS - 1)) {
+        struct sr_timer *all = NULL;
+        for (level = 0; level < SR_WHEEL_LEVELS; level++) {
+            for (i = 0; i < SR_WHEEL_SIZE; i++) {
+                while ((timer = wheel->slots[level][i]) != NULL) {
+                    sr_wheel_unlink(timer);
+                    timer->next = all;
+                    all = timer;
+                }
+            }
+        }
+        wheel->now = now - 1;
+        while (all != NULL) {
+            timer = all;
+            all = all->next;
+            sr_wheel_place(wheel, timer);
+        }
+    }
+
+    while (wheel->now < now) {
+        wheel->now++;
+
+        /* Refill the finer levels when their index wraps around */
+        for (level = 1; level < SR_WHEEL_LEVELS; level++) {
+            if ((wheel->now & (LEVEL_SPAN(level) - 1)) != 0) {
+                break;
+            }
+        }
+        for (level = level - 1; level >= 1; level--) {
+            sr_wheel_cascade(wheel, level,
+                             (wheel->now >> (SR_WHEEL_BITS * level)) & SR_WHEEL_MASK);
+        }
+
+        /* Take timers off one at a time: a callback may cancel others
+           that sit in the same slot. */
+        while ((timer = wheel->slots[0][wheel->now & SR_WHEEL_MASK]) != NULL) {
+            sr_wheel_unlink(timer);
+            timer->expire(ctx, timer);
+        }
+    }
+}
@@ -0,0 +1,58 @@
+/* This file defines a hierarchical timing wheel with one second resolution.
+
+   A timer is embedded in the object it times out. Level 0 has one slot per
+   second for the next SR_WHEEL_SIZE seconds; each higher level has slots
+   SR_WHEEL_SIZE times coarser. Adding or cancelling a timer is O(1), and
+   advancing the wheel only touches the timers in the slot that became due,
+   plus an occasional cascade of a coarse slot into the finer levels.
+
+   The wheel is not thread safe; callers serialize access with their own
+   lock. A timer's expire callback runs from sr_wheel_advance with that lock
+   held and may re-add or cancel any timer, including itself.
+ */
+
+#ifndef SR_TIMERWHEEL_H
+#define SR_TIMERWHEEL_H
+
+#include <time.h>
+
+#define SR_WHEEL_BITS   8
+#define SR_WHEEL_SIZE   (1 << SR_WHEEL_BITS)
+#define SR_WHEEL_MASK   (SR_WHEEL_SIZE - 1)
+#define SR_WHEEL_LEVELS 3
+
+struct sr_timer {
+    time_t expires;             /* Second at which the timer fires */
+    void (*expire)(void *ctx, struct sr_timer *timer);
+    void *data;                 /* Object the timer belongs to */
+
+    struct sr_timer *next, *prev;
+    struct sr_timer **slot;     /* Slot list we are on, NULL if not pending */
+};
+
+struct sr_wheel {
+    time_t now;                 /* Last second processed */
+    struct sr_timer *slots[SR_WHEEL_LEVELS][SR_WHEEL_SIZE];
+};
+
+void sr_wheel_init(struct sr_wheel *wheel, time_t now);
+
+/* Prepares a timer that is not on any wheel yet. */
+void sr_timer_init(struct sr_timer *timer,
+                   void (*expire)(void *ctx, struct sr_timer *timer),
+                   void *data);
+
+/* Arms the timer to fire at expires, moving it if it is already pending.
+   A time that has already passed fires on the next advance. */
+void sr_wheel_add(struct sr_wheel *wheel, struct sr_timer *timer, time_t expires);
+
+/* Cancels the timer if it is pending. */
+void sr_wheel_del(struct sr_wheel *wheel, struct sr_timer *timer);
+
+/* Returns nonzero if the timer is armed. */
+int sr_timer_pending(struct sr_timer *timer);
+
+/* Runs the expire callback of every timer due at or before now. */
+void sr_wheel_advance(struct sr_wheel *wheel, time_t now, void *ctx);
+
+#endif
@@ -5,7 +5,8 @@
 #include "sr_utils.h"
 
 
-uint16_t cksum (const void *_data, int len) {
+/* Reference implementation, one big endian word at a time. */
+uint16_t cksum_ref (const void *_data, int len) {
   const uint8_t *data = _data;
   uint32_t sum;
 
@@ -19,6 +20,142 @@ uint16_t cksum (const void *_data, int len) {
   return sum ? sum : 0xffff;
 }
 
+/* The kernels below add the data as host order words, which gives the
+   ones' complement sum in the same byte order as the packet (RFC 1071,
+   "byte order independence"). They return it in a 64-bit accumulator,
+   carries are only folded once at the end. */
+
+/* Adds the last len < 8 bytes, zero padded to a 64-bit word. */
+static uint64_t cksum_tail(uint64_t sum, const uint8_t *data, int len) {
+  uint64_t word = 0;
+
+  memcpy(&word, data, len);
+  sum += word & 0xffffffff;
+  return sum + (word >> 32);
+}
+
+static uint64_t cksum_sum64(const uint8_t *data, int len, uint64_t sum) {
+  uint32_t words[4];
+
+  for (; len >= 16; data += 16, len -= 16) {
+    memcpy(words, data, 16);
+    sum += (uint64_t) words[0] + words[1] + words[2] + words[3];
+  }
+  for (; len >= 4; data += 4, len -= 4) {
+    memcpy(words, data, 4);
+    sum += words[0];
+  }
+  return cksum_tail(sum, data, len);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* Each 32-bit word is widened into a 64-bit lane, so lanes cannot overflow
+   for any length that fits in an int. */
+__attribute__((target("sse2")))
+static uint64_t cksum_sum_sse2(const uint8_t *data, int len, uint64_t sum) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  uint64_t lanes[2];
+
+  for (; len >= 16; data += 16, len -= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) data);
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+  }
+  _mm_storeu_si128((__m128i *) lanes, acc);
+  return cksum_sum64(data, len, sum + lanes[0] + lanes[1]);
+}
+
+__attribute__((target("avx2")))
+static uint64_t cksum_sum_avx2(const uint8_t *data, int len, uint64_t sum) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i acc = zero;
+  uint64_t lanes[4];
+
+  for (; len >= 32; data += 32, len -= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) data);
+    acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+    acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+  }
+  _mm256_storeu_si256((__m256i *) lanes, acc);
+  return cksum_sum64(data, len, sum + lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+#endif
+
+static uint64_t cksum_dispatch(const uint8_t *data, int len, uint64_t sum);
+
+/* Best kernel for this cpu, picked on the first call. */
+static uint64_t (*cksum_sum)(const uint8_t *, int, uint64_t) = cksum_dispatch;
+
+static uint64_t cksum_dispatch(const uint8_t *data, int len, uint64_t sum) {
+  uint64_t (*best)(const uint8_t *, int, uint64_t) = cksum_sum64;
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    best = cksum_sum_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    best = cksum_sum_sse2;
+#endif
+  cksum_sum = best;
+  return best(data, len, sum);
+}
+
+uint16_t cksum (const void *_data, int len) {
+  uint64_t sum = cksum_sum(_data, len, 0);
+  uint16_t res;
+
+  while (sum > 0xffff)
+    sum = (sum >> 16) + (sum & 0xffff);
+  res = ~sum;
+  return res ? res : 0xffff;
+}
+
+/* Incremental update, RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m'). The
+   ones' complement sum does not care about byte order, so words are taken
+   exactly as they sit in the packet. acc collects ~m + m' for every word
+   that changed; cksum_adjust folds it into the old checksum. */
+uint32_t cksum_diff16(uint32_t acc, uint16_t old_word, uint16_t new_word) {
+  return acc + (uint16_t) ~old_word + new_word;
+}
+
+uint32_t cksum_diff32(uint32_t acc, uint32_t old_word, uint32_t new_word) {
+  acc = cksum_diff16(acc, old_word >> 16, new_word >> 16);
+  return cksum_diff16(acc, old_word & 0xffff, new_word & 0xffff);
+}
+
+uint16_t cksum_adjust(uint16_t sum, uint32_t acc) {
+  uint32_t s = (uint16_t) ~sum + acc;
+
+  while (s > 0xffff)
+    s = (s >> 16) + (s & 0xffff);
+  return ~s;
+}
+
+/* A udp checksum of zero means there is none (RFC 768), keep it that way,
+   and send a computed zero as 0xffff. */
+uint16_t cksum_adjust_udp(uint16_t sum, uint32_t acc) {
+  if (sum == 0)
+    return 0;
+  sum = cksum_adjust(sum, acc);
+  return sum ? sum : 0xffff;
+}
+
+/* RFC 1141: the ttl shares a header word with the protocol, so the word
+   before and after the decrement goes into the same single adjustment as
+   any other rewrite the caller collected in acc. */
+void ip_decrement_ttl(sr_ip_hdr_t *iphdr, uint32_t acc) {
+  uint16_t old_word, new_word;
+
+  memcpy(&old_word, &(iphdr->ip_ttl), sizeof(uint16_t));
+  iphdr->ip_ttl--;
+  memcpy(&new_word, &(iphdr->ip_ttl), sizeof(uint16_t));
+
+  iphdr->ip_sum = cksum_adjust(iphdr->ip_sum, cksum_diff16(acc, old_word, new_word));
+}
+
 
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
@@ -28,7 +28,25 @@
 #ifndef SR_UTILS_H
 #define SR_UTILS_H
 
+/* Internet checksum of len bytes, in network byte order. Uses the widest
+   kernel the cpu supports; cksum_ref is the plain scalar version. */
 uint16_t cksum(const void *_data, int len);
+uint16_t cksum_ref(const void *_data, int len);
+
+/* Checksum update for rewritten header fields, all values as found in the
+   packet (network byte order). Start with acc = 0, add every changed
+   word, then apply to the old checksum:
+     acc = cksum_diff32(0, ip->ip_src, new_src);
+     tcp->checksum = cksum_adjust(tcp->checksum, acc); */
+uint32_t cksum_diff16(uint32_t acc, uint16_t old_word, uint16_t new_word);
+uint32_t cksum_diff32(uint32_t acc, uint32_t old_word, uint32_t new_word);
+uint16_t cksum_adjust(uint16_t sum, uint32_t acc);
+/* Same for a udp checksum, which may be absent (zero). */
+uint16_t cksum_adjust_udp(uint16_t sum, uint32_t acc);
+
+/* Decrements the ttl of a packet being forwarded and patches the header
+   checksum for it and for the header changes already collected in acc. */
+void ip_decrement_ttl(sr_ip_hdr_t *iphdr, uint32_t acc);
 
 uint16_t ethertype(uint8_t *buf);
 uint8_t ip_protocol(uint8_t *buf);
@@ -365,6 +365,10 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
             bytes_read += ret;
         } while ( errno == EINTR); /* be mindful of signals */
 
+        if ( ret == 0 )
+        { /* -- server gone, or SIGINT/SIGTERM shut us down (sr_main.c) -- */
+            return 0;
+        }
     }
 
     len = ntohl(len);
@@ -404,6 +408,12 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
             }
             bytes_read += ret;
         } while (errno == EINTR); /* be mindful of signals */
+
+        if ( ret == 0 )
+        {
+            free(buf);
+            return 0;
+        }
     }
 
     /* My entry for most unreadable line of code - guido */